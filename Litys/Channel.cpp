@@ -0,0 +1,398 @@
+#include <cstring>
+#include <iostream>
+#include <thread>
+
+#include "Channel.h"
+#include "Isolate.h"
+#include "Native.h"
+
+static const char* TypeName(ObjectType type)
+{
+	switch (type)
+	{
+	case OT_FUNCTION:
+		return "function";
+	case OT_IFUNCTION:
+		return "native function";
+	case OT_MAPPED_FILE:
+		return "mapped file";
+	case OT_FILE_WRITER:
+		return "file writer";
+	case OT_SLICE_ITERATOR:
+		return "iterator";
+	case OT_COROUTINE:
+		return "coroutine";
+	default:
+		return "object";
+	}
+}
+
+bool Packet::Add(Value value, bool move)
+{
+	Slot slot;
+	if (!Pack(value, move, slot)) {
+		moves.clear();
+		return false;
+	}
+	roots.push_back(slot);
+
+	// Nothing is taken from the sender unless all of the value could be packed.
+	for (auto& i : moves)
+		Take(nodes[i.first], i.second, move);
+	moves.clear();
+	return true;
+}
+
+bool Packet::Pack(Value value, bool move, Slot& slot)
+{
+	slot = Slot();
+	if (value.type == V_CSTRING) {
+		slot.node = static_cast<int>(nodes.size());
+		nodes.emplace_back();
+		nodes.back().type = OT_STRING;
+		nodes.back().text = make_shared<string>(value.as.c_str);
+	}
+	else if (value.type == V_OBJECT)
+		slot.node = PackObject(value.as.object, move);
+	else
+		slot.value = value;
+	return slot.node >= 0 || value.type != V_OBJECT;
+}
+
+int Packet::PackObject(Object* object, bool move)
+{
+	auto found = copied.find(object);
+	if (found != copied.end())
+		return found->second;
+
+	int index = static_cast<int>(nodes.size());
+	nodes.emplace_back();
+	nodes[index].type = object->type;
+	copied[object] = index;
+
+	Slot slot;
+	switch (object->type)
+	{
+	case OT_ARRAY:
+		for (auto& i : static_cast<ValueVectorObject*>(object)->vector) {
+			if (!Pack(i, move, slot))
+				return -1;
+			nodes[index].slots.push_back(slot);
+		}
+		break;
+	case OT_TABLE:
+	{
+		auto table = static_cast<ValueTableObject*>(object);
+		for (auto& i : table->table) {
+			if (!Pack(i.second, move, slot))
+				return -1;
+			nodes[index].names.push_back(i.first);
+			nodes[index].slots.push_back(slot);
+		}
+		for (auto& i : table->array) {
+			if (!Pack(i, move, slot))
+				return -1;
+			nodes[index].slots.push_back(slot);
+		}
+		nodes[index].array = table->array.size();
+		for (auto& i : table->hash) {
+			Slot key;
+			if (!Pack(i.first, move, key) || !Pack(i.second, move, slot))
+				return -1;
+			nodes[index].slots.push_back(key);
+			nodes[index].slots.push_back(slot);
+		}
+		if (table->meta != nullptr) {
+			int meta = PackObject(table->meta, move);
+			if (meta < 0)
+				return -1;
+			nodes[index].meta = meta;
+		}
+		break;
+	}
+	case OT_STRING:
+	case OT_FLOAT64_ARRAY:
+	case OT_INT32_ARRAY:
+	case OT_UINT8_ARRAY:
+		if (move)
+			moves.push_back({ index, object });
+		else
+			Take(nodes[index], object, false);
+		break;
+	case OT_CHANNEL:
+		nodes[index].channel = static_cast<ChannelObject*>(object)->channel;
+		break;
+	default:
+		refused = TypeName(object->type);
+		return -1;
+	}
+	return index;
+}
+
+// Moves the characters or elements of object into node when nothing else
+// sees them, copies them otherwise.
+void Packet::Take(Node& node, Object* object, bool move)
+{
+	if (object->type == OT_STRING) {
+		auto string = static_cast<StringObject*>(object);
+		if (move && string->view == nullptr && !string->constant && string->buffer.use_count() == 1) {
+			node.text = string->buffer;
+			node.text->resize(string->length);
+			string->buffer = make_shared<std::string>();
+			string->length = 0;
+		}
+		else
+			node.text = make_shared<std::string>(string->Data(), string->Length());
+		return;
+	}
+
+	auto array = static_cast<TypedArrayObject*>(object);
+	node.length = array->length;
+	if (move && array->owner == array && array->slices == 0) {
+		node.data.reset(array->data);
+		array->data = new char[0];
+		array->length = 0;
+	}
+	else {
+		size_t size = static_cast<size_t>(array->length) * array->ElementSize();
+		node.data.reset(new char[size]);
+		memcpy(node.data.get(), array->data, size);
+	}
+}
+
+int Packet::Unpack(VM* vm)
+{
+	// Objects made so far are kept in holder until the graph is linked, any
+	// of them may be collected otherwise.
+	auto holder = new ValueVectorObject();
+	vm->NewObject(holder);
+	vm->Push(holder);
+
+	vector<Object*> objects;
+	for (auto& i : nodes) {
+		Object* object;
+		switch (i.type)
+		{
+		case OT_ARRAY:
+			object = new ValueVectorObject();
+			break;
+		case OT_TABLE:
+			object = new ValueTableObject();
+			break;
+		case OT_STRING:
+			object = new StringObject(i.text, i.text->size());
+			break;
+		case OT_CHANNEL:
+			object = new ChannelObject(i.channel);
+			break;
+		default:
+			object = new TypedArrayObject(i.type, i.data.release(), i.length);
+			break;
+		}
+		vm->NewObject(object);
+		holder->vector.push_back(Value(object));
+		objects.push_back(object);
+	}
+
+	for (size_t i = 0; i < nodes.size(); i++) {
+		auto& node = nodes[i];
+		if (node.type == OT_ARRAY) {
+			auto array = static_cast<ValueVectorObject*>(objects[i]);
+			for (auto& j : node.slots)
+				array->Push(Get(j, objects));
+		}
+		else if (node.type == OT_TABLE) {
+			auto table = static_cast<ValueTableObject*>(objects[i]);
+			size_t slot = 0;
+			for (auto& j : node.names)
+				table->Set(Value(j.c_str()), Get(node.slots[slot++], objects));
+			for (size_t j = 0; j < node.array; j++)
+				table->array.push_back(Get(node.slots[slot++], objects));
+			for (; slot < node.slots.size(); slot += 2)
+				table->Set(Get(node.slots[slot], objects), Get(node.slots[slot + 1], objects));
+			if (node.meta >= 0)
+				table->meta = static_cast<ValueTableObject*>(objects[node.meta]);
+		}
+	}
+
+	vm->Pop();
+	for (auto& i : roots)
+		vm->Push(Get(i, objects));
+	return Count();
+}
+
+Value Packet::Get(Slot& slot, vector<Object*>& objects)
+{
+	return slot.node >= 0 ? Value(objects[slot.node]) : slot.value;
+}
+
+int Packet::Count()
+{
+	return static_cast<int>(roots.size());
+}
+
+const char* Packet::Refused()
+{
+	return refused != nullptr ? refused : "value";
+}
+
+Channel::Channel() : head(new Node()), tail(head.load()) {}
+
+Channel::~Channel()
+{
+	while (tail != nullptr) {
+		Node* next = tail->next.load();
+		delete tail;
+		tail = next;
+	}
+}
+
+void Channel::Send(Packet packet)
+{
+	auto node = new Node();
+	node->packet = move(packet);
+	head.exchange(node)->next.store(node);
+	if (sleeping.load() > 0) {
+		lock_guard<mutex> guard(lock);
+		ready.notify_all();
+	}
+}
+
+bool Channel::TryReceive(Packet& packet)
+{
+	while (receiving.test_and_set(memory_order_acquire))
+		this_thread::yield();
+	Node* next = tail->next.load();
+	if (next != nullptr) {
+		packet = move(next->packet);
+		delete tail;
+		tail = next;
+	}
+	receiving.clear(memory_order_release);
+	return next != nullptr;
+}
+
+// A sender that sees nobody sleeping has linked its packet in before the
+// receiver looks again, one that does takes the lock and so cannot notify
+// before the receiver waits.
+Packet Channel::Receive()
+{
+	Packet packet;
+	if (TryReceive(packet))
+		return packet;
+	unique_lock<mutex> guard(lock);
+	sleeping++;
+	while (!TryReceive(packet))
+		ready.wait(guard);
+	sleeping--;
+	return packet;
+}
+
+bool Channel::Receive(Packet& packet, chrono::milliseconds timeout)
+{
+	if (TryReceive(packet))
+		return true;
+	unique_lock<mutex> guard(lock);
+	sleeping++;
+	bool received = TryReceive(packet);
+	if (!received) {
+		ready.wait_for(guard, timeout);
+		received = TryReceive(packet);
+	}
+	sleeping--;
+	return received;
+}
+
+ChannelObject::ChannelObject(shared_ptr<Channel> channel) : channel(channel) { type = OT_CHANNEL; }
+
+int ChannelObject::Size()
+{
+	return sizeof(ChannelObject);
+}
+
+string ChannelObject::ToString()
+{
+	return "<channel>";
+}
+
+static Channel* ChannelOf(Value value)
+{
+	if (value.type != V_OBJECT || value.as.object->type != OT_CHANNEL)
+		return nullptr;
+	return static_cast<ChannelObject*>(value.as.object)->channel.get();
+}
+
+static Value MakeChannel(VM* vm)
+{
+	auto channel = new ChannelObject(make_shared<Channel>());
+	vm->NewObject(channel);
+	return Value(channel);
+}
+
+static void Transfer(const char* name, Value target, Value value, bool move)
+{
+	auto channel = ChannelOf(target);
+	if (channel == nullptr) {
+		std::cout << "Error: " << name << " expects a channel." << std::endl;
+		return;
+	}
+	Packet packet;
+	if (!packet.Add(value, move)) {
+		std::cout << "Error: " << name << " cannot transfer a " << packet.Refused() << "." << std::endl;
+		return;
+	}
+	channel->Send(std::move(packet));
+}
+
+static void Send(Value channel, Value value)
+{
+	Transfer("send", channel, value, false);
+}
+
+static void SendMove(Value channel, Value value)
+{
+	Transfer("send_move", channel, value, true);
+}
+
+static Value Receive(VM* vm, Value target)
+{
+	auto channel = ChannelOf(target);
+	if (channel == nullptr) {
+		std::cout << "Error: recv expects a channel." << std::endl;
+		return Value();
+	}
+	// The sender may be a task queued behind this isolate, so a receiver
+	// with a pool runs queued tasks while it waits, as IsolatePool::Wait does.
+	Packet packet;
+	if (vm->isolates == nullptr)
+		packet = channel->Receive();
+	else
+		while (!channel->TryReceive(packet))
+			if (!vm->isolates->RunPending() && channel->Receive(packet, chrono::milliseconds(1)))
+				break;
+	packet.Unpack(vm);
+	return vm->Pop();
+}
+
+static Value TryReceive(VM* vm, Value target)
+{
+	auto channel = ChannelOf(target);
+	if (channel == nullptr) {
+		std::cout << "Error: try_recv expects a channel." << std::endl;
+		return Value();
+	}
+	Packet packet;
+	if (!channel->TryReceive(packet))
+		return Value();
+	packet.Unpack(vm);
+	return vm->Pop();
+}
+
+void BindChannels(VM& vm)
+{
+	vm.Bind("channel", MakeChannel);
+	vm.Bind("send", Send);
+	vm.Bind("send_move", SendMove);
+	vm.Bind("recv", Receive);
+	vm.Bind("try_recv", TryReceive);
+}
@@ -0,0 +1,93 @@
+#ifndef CHANNEL_H
+#define CHANNEL_H
+
+#include <atomic>
+#include <chrono>
+#include <mutex>
+#include <condition_variable>
+#include <map>
+#include <memory>
+#include <vector>
+
+#include "Object.h"
+
+class Channel;
+
+// Copy of a value graph that belongs to no heap, made by the sending
+// isolate and rebuilt in the heap of the receiving one. An object reached
+// more than once is copied once, so shared parts and cycles survive.
+// Moving hands over the characters of a string or the elements of a typed
+// array instead of copying them, and leaves the sender's object empty.
+class Packet {
+public:
+	// Adds a value, false when some part of it cannot leave its heap.
+	bool Add(Value value, bool move);
+	// Pushes the values added, in order, and returns how many there are.
+	int Unpack(VM* vm);
+	int Count();
+	// Name of the first object Add refused.
+	const char* Refused();
+private:
+	struct Slot {
+		Value value; // nil, a bool or a number
+		int node = -1; // index of the object otherwise
+	};
+	struct Node {
+		ObjectType type;
+		vector<Slot> slots; // elements; values of names, array part, then hash keys and values of a table
+		vector<string> names; // string keys of a table
+		size_t array = 0; // array part of a table
+		int meta = -1;
+		shared_ptr<string> text;
+		unique_ptr<char[]> data; // typed array elements
+		int length = 0;
+		shared_ptr<Channel> channel;
+	};
+	vector<Slot> roots;
+	vector<Node> nodes;
+	map<Object*, int> copied;
+	vector<pair<int, Object*>> moves; // taken from the sender once the whole value is packed
+	const char* refused = nullptr;
+	bool Pack(Value value, bool move, Slot& slot);
+	int PackObject(Object* object, bool move);
+	void Take(Node& node, Object* object, bool move);
+	Value Get(Slot& slot, vector<Object*>& objects);
+};
+
+// Queue of packets between isolates. Senders link their packet in with a
+// single atomic exchange and never wait; receivers take turns through an
+// atomic flag and sleep only while the queue is empty.
+class Channel {
+public:
+	Channel();
+	~Channel();
+	void Send(Packet packet);
+	bool TryReceive(Packet& packet);
+	Packet Receive();
+	// Waits at most timeout for a packet, false when none came.
+	bool Receive(Packet& packet, chrono::milliseconds timeout);
+private:
+	struct Node {
+		atomic<Node*> next{ nullptr };
+		Packet packet;
+	};
+	atomic<Node*> head; // last packet sent
+	Node* tail; // stub before the next packet to receive
+	atomic_flag receiving = ATOMIC_FLAG_INIT;
+	atomic<int> sleeping{ 0 };
+	mutex lock;
+	condition_variable ready;
+};
+
+class ChannelObject : public Object {
+public:
+	shared_ptr<Channel> channel;
+	ChannelObject(shared_ptr<Channel> channel);
+	virtual int Size();
+	string ToString();
+};
+
+// Binds channel, send, send_move, recv and try_recv.
+void BindChannels(VM& vm);
+
+#endif
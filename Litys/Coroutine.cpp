@@ -0,0 +1,185 @@
+#include <iostream>
+#include <new>
+
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#else
+#include <sys/mman.h>
+#endif
+
+#include "Coroutine.h"
+#include "Native.h"
+
+// Address space that takes memory only once committed.
+static void* Reserve(size_t size)
+{
+#ifdef _WIN32
+	return VirtualAlloc(nullptr, size, MEM_RESERVE, PAGE_NOACCESS);
+#else
+	void* address = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+	return address != MAP_FAILED ? address : nullptr;
+#endif
+}
+
+// Pages of a mapping get memory when first touched, so only Windows
+// commits them here.
+static bool Commit(void* address, size_t size)
+{
+#ifdef _WIN32
+	return VirtualAlloc(address, size, MEM_COMMIT, PAGE_READWRITE) != nullptr;
+#else
+	(void)address;
+	(void)size;
+	return true;
+#endif
+}
+
+static void Release(void* address, size_t size)
+{
+	if (address == nullptr)
+		return;
+#ifdef _WIN32
+	VirtualFree(address, 0, MEM_RELEASE);
+#else
+	munmap(address, size);
+#endif
+}
+
+CoroutineObject::CoroutineObject(FunctionObject* function) : function(function)
+{
+	type = OT_COROUTINE;
+	context.stack = static_cast<Value*>(Reserve(sizeof(Value) * COROUTINE_STACK));
+	frames = static_cast<Frame*>(Reserve(sizeof(Frame) * COROUTINE_FRAMES));
+	// One that gets no room is dead from the start.
+	if (context.stack == nullptr || frames == nullptr
+		|| !Commit(context.stack, sizeof(Value) * COROUTINE_FIRST_STACK)
+		|| !Commit(frames + COROUTINE_FRAMES - COROUTINE_FIRST_FRAMES, sizeof(Frame) * COROUTINE_FIRST_FRAMES)) {
+		state = CO_DEAD;
+		return;
+	}
+	for (size_t i = 0; i < COROUTINE_FIRST_STACK; i++)
+		new (context.stack + i) Value();
+	context.stack_size = COROUTINE_FIRST_STACK;
+	context.pointer = context.stack;
+	context.frames_pool = frames + COROUTINE_FRAMES - COROUTINE_FIRST_FRAMES;
+	for (int i = 0; i < COROUTINE_FIRST_FRAMES; i++)
+		new (context.frames_pool + i) Frame();
+	context.frames_pool_size = COROUTINE_FIRST_FRAMES;
+	context.frames_pool_pointer = context.frames_pool + COROUTINE_FIRST_FRAMES - 1;
+}
+
+CoroutineObject::~CoroutineObject()
+{
+	Release(context.stack, sizeof(Value) * COROUTINE_STACK);
+	Release(frames, sizeof(Frame) * COROUTINE_FRAMES);
+}
+
+// An error that ends the coroutine leaves current past the end of the
+// code, which is what makes Run return here.
+Value CoroutineObject::Next(VM* vm)
+{
+	int current = vm->current;
+	if (vm->Resume(this, 0, true))
+		vm->Run();
+	vm->current = current;
+	return vm->Pop();
+}
+
+// The stack grows up from its start.
+bool CoroutineObject::GrowStack(VM* vm, size_t count)
+{
+	size_t needed = static_cast<size_t>(vm->pointer - vm->stack) + 1 + count;
+	size_t size = vm->stack_size;
+	while (size < needed && size < COROUTINE_STACK)
+		size = size * 2 < COROUTINE_STACK ? size * 2 : COROUTINE_STACK;
+	if (size < needed || !Commit(vm->stack + vm->stack_size, sizeof(Value) * (size - vm->stack_size)))
+		return false;
+	for (size_t i = vm->stack_size; i < size; i++)
+		new (vm->stack + i) Value();
+	vm->bytes_allocated += static_cast<int>(sizeof(Value) * (size - vm->stack_size));
+	vm->stack_size = size;
+	return true;
+}
+
+// Frames are taken from the end of the pool down, so it grows down.
+bool CoroutineObject::GrowFrames(VM* vm)
+{
+	int size = vm->frames_pool_size;
+	if (size >= COROUTINE_FRAMES)
+		return false;
+	int grown = size * 2 < COROUTINE_FRAMES ? size * 2 : COROUTINE_FRAMES;
+	Frame* pool = frames + COROUTINE_FRAMES - grown;
+	if (!Commit(pool, sizeof(Frame) * (grown - size)))
+		return false;
+	for (Frame* f = pool; f < vm->frames_pool; f++)
+		new (f) Frame();
+	vm->bytes_allocated += static_cast<int>(sizeof(Frame) * (grown - size));
+	vm->frames_pool = pool;
+	vm->frames_pool_size = grown;
+	return true;
+}
+
+void CoroutineObject::Operate(VM* vm, Operation operation)
+{
+	if (operation.code == OP_CALL)
+		vm->Resume(this, static_cast<int>(operation.value.as.integer), false);
+	else
+		Object::Operate(vm, operation);
+}
+
+// A running coroutine is marked through the VM registers, or through the
+// caller of the one it resumed; whoever resumed it is marked from here.
+void CoroutineObject::MarkObjects(VM* vm)
+{
+	vm->MarkObject(function);
+	if (state == CO_SUSPENDED)
+		vm->MarkContext(context);
+	else if (state == CO_RUNNING) {
+		vm->MarkContext(caller);
+		if (resumer != nullptr)
+			vm->MarkObject(resumer);
+	}
+}
+
+int CoroutineObject::Size()
+{
+	return static_cast<int>(sizeof(CoroutineObject) + sizeof(Value) * COROUTINE_FIRST_STACK + sizeof(Frame) * COROUTINE_FIRST_FRAMES);
+}
+
+string CoroutineObject::ToString()
+{
+	return "<coroutine>";
+}
+
+static Value MakeCoroutine(VM* vm, Value function)
+{
+	if (function.type != V_OBJECT || function.as.object->type != OT_FUNCTION) {
+		std::cout << "Error: coroutine expects a function." << std::endl;
+		return Value();
+	}
+	auto coroutine = new CoroutineObject(static_cast<FunctionObject*>(function.as.object));
+	if (coroutine->state == CO_DEAD) {
+		delete coroutine;
+		std::cout << "Error: out of memory for a coroutine." << std::endl;
+		return Value();
+	}
+	vm->NewObject(coroutine);
+	return Value(coroutine);
+}
+
+static Value Status(VM* vm, Value coroutine)
+{
+	if (coroutine.type != V_OBJECT || coroutine.as.object->type != OT_COROUTINE) {
+		std::cout << "Error: status expects a coroutine." << std::endl;
+		return Value();
+	}
+	const char* names[] = { "suspended", "running", "dead" };
+	return Value(vm->Intern(names[static_cast<CoroutineObject*>(coroutine.as.object)->state]));
+}
+
+void BindCoroutines(VM& vm)
+{
+	vm.Bind("coroutine", MakeCoroutine);
+	vm.Bind("status", Status);
+}
@@ -0,0 +1,51 @@
+#ifndef COROUTINE_H
+#define COROUTINE_H
+
+#include "Object.h"
+
+// Room of a coroutine: values on its stack segment and nested frames. It
+// starts with the first, and doubles as calls need up to the most, the
+// same room the main program has. The most is reserved as address space
+// at once and takes memory only as it is reached, so growing never moves
+// a value or a frame.
+const size_t COROUTINE_FIRST_STACK = 512;
+const size_t COROUTINE_STACK = 1024 * 1024 / sizeof(Value);
+const int COROUTINE_FIRST_FRAMES = 4;
+const int COROUTINE_FRAMES = 1024;
+
+enum CoroutineState { CO_SUSPENDED, CO_RUNNING, CO_DEAD };
+
+// Function running on a stack segment and a frame pool of its own, so it
+// can stop with yield at any depth of calls and go on from there when
+// resumed. While it runs, the registers of whoever resumed it are kept in
+// caller; once it yields, its own are kept in context.
+class CoroutineObject : public Object {
+public:
+	FunctionObject* function;
+	CoroutineState state = CO_SUSPENDED;
+	bool started = false;
+	bool nested = false; // resumed by a native, which runs it in a Run of its own
+	bool push_result = false; // the yield it stopped at takes the value it is resumed with
+	Context context;
+	Context caller;
+	CoroutineObject* resumer = nullptr;
+	CoroutineObject(FunctionObject* function);
+	~CoroutineObject();
+	// Resumes it from a native and returns what it yields, nil once it is done.
+	Value Next(VM* vm);
+	// Make room while it runs, for count more values on the stack or for
+	// more frames; false once it has the most.
+	bool GrowStack(VM* vm, size_t count);
+	bool GrowFrames(VM* vm);
+	virtual void Operate(VM* vm, Operation operation);
+	virtual void MarkObjects(VM* vm);
+	virtual int Size();
+	string ToString();
+private:
+	Frame* frames; // start of the reserved frame pool, which is used from the end
+};
+
+// Binds coroutine and status.
+void BindCoroutines(VM& vm);
+
+#endif
@@ -0,0 +1,299 @@
+#include <cstring>
+#include <iostream>
+#include <fcntl.h>
+#include <sys/stat.h>
+
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#include <io.h>
+#else
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
+#include "File.h"
+#include "Native.h"
+#include "Coroutine.h"
+
+static Value Fail(const char* name, const char* expected)
+{
+	std::cout << "Error: " << name << " expects " << expected << "." << std::endl;
+	return Value();
+}
+
+MappedFileObject::MappedFileObject() { type = OT_MAPPED_FILE; }
+
+MappedFileObject::~MappedFileObject() { Close(); }
+
+bool MappedFileObject::Open(const char* path)
+{
+#ifdef _WIN32
+	file = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, nullptr);
+	if (file == INVALID_HANDLE_VALUE) {
+		file = nullptr;
+		return false;
+	}
+	LARGE_INTEGER length;
+	if (!GetFileSizeEx(file, &length)) {
+		Close();
+		return false;
+	}
+	size = static_cast<size_t>(length.QuadPart);
+	if (size == 0)
+		return true;
+	mapping = CreateFileMappingA(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+	if (mapping != nullptr)
+		data = static_cast<const char*>(MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0));
+	if (data == nullptr) {
+		Close();
+		return false;
+	}
+	return true;
+#else
+	int fd = open(path, O_RDONLY);
+	if (fd < 0)
+		return false;
+	struct stat status;
+	if (fstat(fd, &status) != 0) {
+		close(fd);
+		return false;
+	}
+	size = static_cast<size_t>(status.st_size);
+	if (size > 0) {
+		void* address = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+		if (address != MAP_FAILED) {
+			data = static_cast<const char*>(address);
+			madvise(address, size, MADV_SEQUENTIAL);
+		}
+	}
+	close(fd);
+	if (size > 0 && data == nullptr) {
+		size = 0;
+		return false;
+	}
+	return true;
+#endif
+}
+
+// Views into the mapping keep this object alive, so it is unmapped only
+// once nothing can read it any more.
+void MappedFileObject::Close()
+{
+#ifdef _WIN32
+	if (data != nullptr)
+		UnmapViewOfFile(data);
+	if (mapping != nullptr)
+		CloseHandle(mapping);
+	if (file != nullptr)
+		CloseHandle(file);
+	mapping = nullptr;
+	file = nullptr;
+#else
+	if (data != nullptr)
+		munmap(const_cast<char*>(data), size);
+#endif
+	data = nullptr;
+	size = 0;
+}
+
+int MappedFileObject::Size()
+{
+	return sizeof(MappedFileObject);
+}
+
+string MappedFileObject::ToString()
+{
+	return "<mapped file of " + to_string(size) + " bytes>";
+}
+
+SliceIteratorObject::SliceIteratorObject(Value value, char separator) : source(value.as.object), separator(separator)
+{
+	type = OT_SLICE_ITERATOR;
+	if (source->type == OT_MAPPED_FILE) {
+		auto file = static_cast<MappedFileObject*>(source);
+		view = file->data;
+		end = file->size;
+	}
+	else {
+		auto string = static_cast<StringObject*>(source);
+		if (string->view != nullptr) {
+			source = string->source;
+			view = string->view;
+		}
+		else
+			buffer = string->buffer;
+		end = string->Length();
+	}
+	// An empty mapping has no characters to point at, so it has no pieces.
+	finished = end == 0 && (separator == '\n' || (view == nullptr && buffer == nullptr));
+}
+
+Value SliceIteratorObject::Next(VM* vm)
+{
+	if (finished)
+		return Value();
+
+	auto first = (view != nullptr ? view : buffer->data()) + position;
+	auto found = static_cast<const char*>(memchr(first, separator, end - position));
+	size_t length = found != nullptr ? found - first : end - position;
+	position += length + 1;
+	// A trailing newline does not start one more line.
+	if (found == nullptr || (separator == '\n' && position >= end))
+		finished = true;
+	if (separator == '\n' && length > 0 && first[length - 1] == '\r')
+		length--;
+
+	StringObject* piece;
+	if (view != nullptr)
+		piece = new StringObject(source, first, length);
+	else
+		piece = new StringObject(make_shared<string>(first, length), length);
+	vm->NewObject(piece);
+	return Value(piece);
+}
+
+void SliceIteratorObject::MarkObjects(VM* vm)
+{
+	if (source != nullptr)
+		vm->MarkObject(source);
+}
+
+int SliceIteratorObject::Size()
+{
+	return sizeof(SliceIteratorObject);
+}
+
+FileWriterObject::FileWriterObject() { type = OT_FILE_WRITER; }
+
+FileWriterObject::~FileWriterObject() { Close(); }
+
+bool FileWriterObject::Open(const char* path)
+{
+#ifdef _WIN32
+	int fd = _open(path, _O_WRONLY | _O_CREAT | _O_TRUNC | _O_BINARY, _S_IREAD | _S_IWRITE);
+#else
+	int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+#endif
+	if (fd < 0)
+		return false;
+	output = new Output(fd);
+	output->policy = FLUSH_BLOCK;
+	return true;
+}
+
+void FileWriterObject::Close()
+{
+	if (output == nullptr)
+		return;
+	int fd = output->Descriptor();
+	delete output;
+	output = nullptr;
+#ifdef _WIN32
+	_close(fd);
+#else
+	close(fd);
+#endif
+}
+
+int FileWriterObject::Size()
+{
+	return sizeof(FileWriterObject) + (output != nullptr ? OUTPUT_BLOCK : 0);
+}
+
+string FileWriterObject::ToString()
+{
+	return output != nullptr ? "<file writer>" : "<closed file writer>";
+}
+
+static Value OpenMap(VM* vm, string path)
+{
+	auto file = new MappedFileObject();
+	if (!file->Open(path.c_str())) {
+		delete file;
+		std::cout << "Error: cannot map file '" << path << "'." << std::endl;
+		return Value();
+	}
+	vm->NewObject(file);
+	return Value(file);
+}
+
+static bool Splittable(Value value)
+{
+	return value.type == V_OBJECT && (value.as.object->type == OT_MAPPED_FILE || value.as.object->type == OT_STRING);
+}
+
+static Value Lines(VM* vm, Value source)
+{
+	if (!Splittable(source))
+		return Fail("lines", "a mapped file or a string");
+	auto iterator = new SliceIteratorObject(source, '\n');
+	vm->NewObject(iterator);
+	return Value(iterator);
+}
+
+static Value Fields(VM* vm, Value source, string separator)
+{
+	if (!Splittable(source) || separator.size() != 1)
+		return Fail("fields", "a mapped file or a string and a one character separator");
+	auto iterator = new SliceIteratorObject(source, separator[0]);
+	vm->NewObject(iterator);
+	return Value(iterator);
+}
+
+static Value Next(VM* vm, Value iterator)
+{
+	if (iterator.type == V_OBJECT && iterator.as.object->type == OT_COROUTINE)
+		return static_cast<CoroutineObject*>(iterator.as.object)->Next(vm);
+	if (iterator.type != V_OBJECT || iterator.as.object->type != OT_SLICE_ITERATOR)
+		return Fail("next", "an iterator from lines, fields or a coroutine");
+	return static_cast<SliceIteratorObject*>(iterator.as.object)->Next(vm);
+}
+
+static Value OpenWrite(VM* vm, string path)
+{
+	auto writer = new FileWriterObject();
+	if (!writer->Open(path.c_str())) {
+		delete writer;
+		std::cout << "Error: cannot open file '" << path << "' for writing." << std::endl;
+		return Value();
+	}
+	vm->NewObject(writer);
+	return Value(writer);
+}
+
+static void WriteTo(Value writer, Arguments arguments)
+{
+	if (writer.type != V_OBJECT || writer.as.object->type != OT_FILE_WRITER) {
+		Fail("write_to", "a file writer");
+		return;
+	}
+	auto output = static_cast<FileWriterObject*>(writer.as.object)->output;
+	if (output == nullptr) {
+		Fail("write_to", "an open file writer");
+		return;
+	}
+	size_t from = output->buffer.size();
+	for (int i = 0; i < arguments.count; i++)
+		arguments[i].AppendTo(output->buffer);
+	output->Written(from);
+}
+
+static void Close(Value value)
+{
+	if (value.type == V_OBJECT && value.as.object->type == OT_FILE_WRITER)
+		static_cast<FileWriterObject*>(value.as.object)->Close();
+	else
+		Fail("close", "a file writer");
+}
+
+void BindFiles(VM& vm)
+{
+	vm.Bind("open_map", OpenMap);
+	vm.Bind("lines", Lines);
+	vm.Bind("fields", Fields);
+	vm.Bind("next", Next);
+	vm.Bind("open_write", OpenWrite);
+	vm.Bind("write_to", WriteTo);
+	vm.Bind("close", Close);
+}
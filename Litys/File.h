@@ -0,0 +1,58 @@
+#ifndef FILE_H
+#define FILE_H
+
+#include "Object.h"
+#include "Output.h"
+
+// Read only bytes of a file mapped into memory. Lines and fields read
+// from it are string views into the mapping, nothing is copied.
+class MappedFileObject : public Object {
+public:
+	const char* data = nullptr;
+	size_t size = 0;
+	MappedFileObject();
+	~MappedFileObject();
+	bool Open(const char* path);
+	virtual int Size();
+	string ToString();
+private:
+	void Close();
+#ifdef _WIN32
+	void* file = nullptr;
+	void* mapping = nullptr;
+#endif
+};
+
+// Hands out the pieces of a mapped file or a string between separators,
+// one per call to Next. Pieces of a mapped file, or of a view into one,
+// are views themselves; pieces of other strings are copied.
+class SliceIteratorObject : public Object {
+public:
+	Object* source;
+	shared_ptr<string> buffer; // characters of a string that is not a view
+	const char* view = nullptr;
+	size_t position = 0;
+	size_t end;
+	char separator;
+	bool finished = false;
+	SliceIteratorObject(Value source, char separator);
+	Value Next(VM* vm);
+	virtual void MarkObjects(VM* vm);
+	virtual int Size();
+};
+
+class FileWriterObject : public Object {
+public:
+	Output* output = nullptr;
+	FileWriterObject();
+	~FileWriterObject();
+	bool Open(const char* path);
+	void Close();
+	virtual int Size();
+	string ToString();
+};
+
+// Binds open_map, lines, fields, next, open_write, write_to and close.
+void BindFiles(VM& vm);
+
+#endif
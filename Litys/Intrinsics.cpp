@@ -0,0 +1,471 @@
+#include <algorithm>
+#include <climits>
+#include <cmath>
+#include <iostream>
+
+#include "Intrinsics.h"
+#include "Native.h"
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define INTRINSICS_SSE2
+#include <emmintrin.h>
+#endif
+
+// Arrays keep count of their numeric elements, so each intrinsic knows in
+// constant time whether it can take the all-doubles path, which works on
+// two elements per SSE2 register, or has to convert element by element.
+
+static Value Fail(const char* name, const char* expected)
+{
+	std::cout << "Error: " << name << " expects " << expected << "." << std::endl;
+	return Value();
+}
+
+static bool Doubles(ValueVectorObject* array)
+{
+	return static_cast<size_t>(array->numbers) == array->vector.size();
+}
+
+static Value Add(Value a, Value b)
+{
+	if (a.type == V_INTEGER && b.type == V_INTEGER) {
+		long long x = a.as.integer, y = b.as.integer;
+		if (!((y > 0 && x > LLONG_MAX - y) || (y < 0 && x < LLONG_MIN - y)))
+			return Value(x + y);
+	}
+	return Value(a.ToNumber() + b.ToNumber());
+}
+
+static Value Multiply(Value a, Value b)
+{
+	if (a.type == V_INTEGER && b.type == V_INTEGER) {
+		long long x = a.as.integer, y = b.as.integer;
+		long long r = static_cast<long long>(static_cast<unsigned long long>(x) * static_cast<unsigned long long>(y));
+		if (x == 0 || (r / x == y && !(x == -1 && y == LLONG_MIN) && !(y == -1 && x == LLONG_MIN)))
+			return Value(r);
+	}
+	return Value(a.ToNumber() * b.ToNumber());
+}
+
+#ifdef INTRINSICS_SSE2
+// Numbers of two consecutive boxed values in one register.
+static __m128d LoadPair(Value* values)
+{
+	return _mm_loadh_pd(_mm_load_sd(&values[0].as.number), &values[1].as.number);
+}
+
+static void StorePair(Value* values, __m128d pair)
+{
+	_mm_storel_pd(&values[0].as.number, pair);
+	_mm_storeh_pd(&values[1].as.number, pair);
+}
+
+static double Lanes(__m128d pair, bool add)
+{
+	double lanes[2];
+	_mm_storeu_pd(lanes, pair);
+	return add ? lanes[0] + lanes[1] : lanes[0] * lanes[1];
+}
+#endif
+
+static double SumDoubles(Value* values, int count)
+{
+	double result = 0;
+	int i = 0;
+#ifdef INTRINSICS_SSE2
+	__m128d a = _mm_setzero_pd(), b = _mm_setzero_pd();
+	for (; i + 4 <= count; i += 4) {
+		a = _mm_add_pd(a, LoadPair(values + i));
+		b = _mm_add_pd(b, LoadPair(values + i + 2));
+	}
+	result = Lanes(_mm_add_pd(a, b), true);
+#endif
+	for (; i < count; i++)
+		result += values[i].as.number;
+	return result;
+}
+
+static double DotDoubles(Value* x, Value* y, int count)
+{
+	double result = 0;
+	int i = 0;
+#ifdef INTRINSICS_SSE2
+	__m128d a = _mm_setzero_pd(), b = _mm_setzero_pd();
+	for (; i + 4 <= count; i += 4) {
+		a = _mm_add_pd(a, _mm_mul_pd(LoadPair(x + i), LoadPair(y + i)));
+		b = _mm_add_pd(b, _mm_mul_pd(LoadPair(x + i + 2), LoadPair(y + i + 2)));
+	}
+	result = Lanes(_mm_add_pd(a, b), true);
+#endif
+	for (; i < count; i++)
+		result += x[i].as.number * y[i].as.number;
+	return result;
+}
+
+static double ExtremeDoubles(Value* values, int count, bool max)
+{
+	double result = values[0].as.number;
+	int i = 0;
+#ifdef INTRINSICS_SSE2
+	if (count >= 2) {
+		__m128d a = LoadPair(values);
+		for (i = 2; i + 2 <= count; i += 2)
+			a = max ? _mm_max_pd(a, LoadPair(values + i)) : _mm_min_pd(a, LoadPair(values + i));
+		double lanes[2];
+		_mm_storeu_pd(lanes, a);
+		result = max ? std::max(lanes[0], lanes[1]) : std::min(lanes[0], lanes[1]);
+	}
+#endif
+	for (; i < count; i++)
+		result = max ? std::max(result, values[i].as.number) : std::min(result, values[i].as.number);
+	return result;
+}
+
+static double SumFloat64(double* values, int count)
+{
+	double result = 0;
+	int i = 0;
+#ifdef INTRINSICS_SSE2
+	__m128d a = _mm_setzero_pd(), b = _mm_setzero_pd();
+	for (; i + 4 <= count; i += 4) {
+		a = _mm_add_pd(a, _mm_loadu_pd(values + i));
+		b = _mm_add_pd(b, _mm_loadu_pd(values + i + 2));
+	}
+	result = Lanes(_mm_add_pd(a, b), true);
+#endif
+	for (; i < count; i++)
+		result += values[i];
+	return result;
+}
+
+static double DotFloat64(double* x, double* y, int count)
+{
+	double result = 0;
+	int i = 0;
+#ifdef INTRINSICS_SSE2
+	__m128d a = _mm_setzero_pd(), b = _mm_setzero_pd();
+	for (; i + 4 <= count; i += 4) {
+		a = _mm_add_pd(a, _mm_mul_pd(_mm_loadu_pd(x + i), _mm_loadu_pd(y + i)));
+		b = _mm_add_pd(b, _mm_mul_pd(_mm_loadu_pd(x + i + 2), _mm_loadu_pd(y + i + 2)));
+	}
+	result = Lanes(_mm_add_pd(a, b), true);
+#endif
+	for (; i < count; i++)
+		result += x[i] * y[i];
+	return result;
+}
+
+static TypedArrayObject* Typed(Value value)
+{
+	if (value.type == V_OBJECT && IsTypedArray(value.as.object->type))
+		return static_cast<TypedArrayObject*>(value.as.object);
+	return nullptr;
+}
+
+static ValueVectorObject* Boxed(Value value)
+{
+	if (value.type == V_OBJECT && value.as.object->type == OT_ARRAY)
+		return static_cast<ValueVectorObject*>(value.as.object);
+	return nullptr;
+}
+
+static Value SumTyped(TypedArrayObject* array)
+{
+	if (array->type == OT_FLOAT64_ARRAY)
+		return Value(SumFloat64(reinterpret_cast<double*>(array->data), array->length));
+
+	long long result = 0;
+	for (int i = 0; i < array->length; i++)
+		result += array->Get(i).as.integer;
+	return Value(result);
+}
+
+static Value Sum(Value value)
+{
+	if (auto typed = Typed(value))
+		return SumTyped(typed);
+	auto array = Boxed(value);
+	if (array == nullptr || !array->Numeric())
+		return Fail("sum", "an array of numbers");
+
+	Value* values = array->vector.data();
+	int count = static_cast<int>(array->vector.size());
+	if (Doubles(array))
+		return Value(SumDoubles(values, count));
+
+	Value result(0LL);
+	for (int i = 0; i < count; i++)
+		result = Add(result, values[i]);
+	return result;
+}
+
+static Value Extreme(ValueVectorObject* array, bool max)
+{
+	const char* name = max ? "max" : "min";
+	if (!array->Numeric() || array->vector.empty())
+		return Fail(name, "a non-empty array of numbers");
+
+	Value* values = array->vector.data();
+	int count = static_cast<int>(array->vector.size());
+	if (Doubles(array))
+		return Value(ExtremeDoubles(values, count, max));
+
+	Value result = values[0];
+	for (int i = 1; i < count; i++)
+	{
+		double a = values[i].ToNumber(), b = result.ToNumber();
+		if (max ? a > b : a < b)
+			result = values[i];
+	}
+	return result;
+}
+
+static Value Min(ValueVectorObject* array)
+{
+	return Extreme(array, false);
+}
+
+static Value Max(ValueVectorObject* array)
+{
+	return Extreme(array, true);
+}
+
+static Value Dot(Value a, Value b)
+{
+	auto p = Typed(a), q = Typed(b);
+	if (p != nullptr && q != nullptr && p->type == OT_FLOAT64_ARRAY && q->type == OT_FLOAT64_ARRAY && p->length == q->length)
+		return Value(DotFloat64(reinterpret_cast<double*>(p->data), reinterpret_cast<double*>(q->data), p->length));
+	if (p != nullptr && q != nullptr && p->length == q->length) {
+		double result = 0;
+		for (int i = 0; i < p->length; i++)
+			result += p->Get(i).ToNumber() * q->Get(i).ToNumber();
+		return Value(result);
+	}
+
+	auto x = Boxed(a), y = Boxed(b);
+	if (x == nullptr || y == nullptr || !x->Numeric() || !y->Numeric() || x->vector.size() != y->vector.size())
+		return Fail("dot", "two arrays of numbers of the same length");
+
+	int count = static_cast<int>(x->vector.size());
+	if (Doubles(x) && Doubles(y))
+		return Value(DotDoubles(x->vector.data(), y->vector.data(), count));
+
+	Value result(0LL);
+	for (int i = 0; i < count; i++)
+		result = Add(result, Multiply(x->vector[i], y->vector[i]));
+	return result;
+}
+
+static ValueVectorObject* Scale(ValueVectorObject* array, Value factor)
+{
+	if (!array->Numeric() || !factor.IsNumeric()) {
+		Fail("scale", "an array of numbers and a number");
+		return nullptr;
+	}
+
+	Value* values = array->vector.data();
+	int count = static_cast<int>(array->vector.size());
+	int i = 0;
+	if (Doubles(array)) {
+		double k = factor.ToNumber();
+#ifdef INTRINSICS_SSE2
+		__m128d pair = _mm_set1_pd(k);
+		for (; i + 2 <= count; i += 2)
+			StorePair(values + i, _mm_mul_pd(LoadPair(values + i), pair));
+#endif
+		for (; i < count; i++)
+			values[i].as.number *= k;
+		return array;
+	}
+
+	for (; i < count; i++)
+		array->Set(i, Multiply(values[i], factor));
+	return array;
+}
+
+static ValueVectorObject* MapAdd(ValueVectorObject* array, Value addend)
+{
+	Value* values = array->vector.data();
+	int count = static_cast<int>(array->vector.size());
+	int i = 0;
+
+	if (addend.type == V_OBJECT && addend.as.object->type == OT_ARRAY) {
+		auto other = static_cast<ValueVectorObject*>(addend.as.object);
+		if (!array->Numeric() || !other->Numeric() || other->vector.size() != array->vector.size()) {
+			Fail("map_add", "two arrays of numbers of the same length");
+			return nullptr;
+		}
+		Value* addends = other->vector.data();
+		if (Doubles(array) && Doubles(other)) {
+#ifdef INTRINSICS_SSE2
+			for (; i + 2 <= count; i += 2)
+				StorePair(values + i, _mm_add_pd(LoadPair(values + i), LoadPair(addends + i)));
+#endif
+			for (; i < count; i++)
+				values[i].as.number += addends[i].as.number;
+			return array;
+		}
+		for (; i < count; i++)
+			array->Set(i, Add(values[i], addends[i]));
+		return array;
+	}
+
+	if (!array->Numeric() || !addend.IsNumeric()) {
+		Fail("map_add", "an array of numbers and a number or array");
+		return nullptr;
+	}
+	if (Doubles(array)) {
+		double k = addend.ToNumber();
+#ifdef INTRINSICS_SSE2
+		__m128d pair = _mm_set1_pd(k);
+		for (; i + 2 <= count; i += 2)
+			StorePair(values + i, _mm_add_pd(LoadPair(values + i), pair));
+#endif
+		for (; i < count; i++)
+			values[i].as.number += k;
+		return array;
+	}
+	for (; i < count; i++)
+		array->Set(i, Add(values[i], addend));
+	return array;
+}
+
+// Orders NaNs after every other number, so the order stays strict weak.
+static bool NumberLess(double a, double b)
+{
+	return std::isnan(b) ? !std::isnan(a) : a < b;
+}
+
+static ValueVectorObject* Sort(ValueVectorObject* array)
+{
+	auto& values = array->vector;
+	if (Doubles(array))
+		std::sort(values.begin(), values.end(), [](const Value& a, const Value& b) { return NumberLess(a.as.number, b.as.number); });
+	else if (array->Numeric())
+		std::sort(values.begin(), values.end(), [](Value a, Value b) { return NumberLess(a.ToNumber(), b.ToNumber()); });
+	else
+		std::sort(values.begin(), values.end(), [](Value a, Value b) { return a.ToString() < b.ToString(); });
+	return array;
+}
+
+static ValueVectorObject* Fill(ValueVectorObject* array, Value value)
+{
+	std::fill(array->vector.begin(), array->vector.end(), value);
+	array->numbers = array->integers = 0;
+	if (!array->vector.empty())
+		array->Count(value, static_cast<int>(array->vector.size()));
+	return array;
+}
+
+static ValueVectorObject* Range(VM* vm, Arguments arguments)
+{
+	if (arguments.count < 1 || arguments.count > 3) {
+		Fail("range", "one to three numbers");
+		return nullptr;
+	}
+	bool integers = true;
+	for (int i = 0; i < arguments.count; i++)
+	{
+		if (!arguments[i].IsNumeric()) {
+			Fail("range", "one to three numbers");
+			return nullptr;
+		}
+		integers = integers && arguments[i].type == V_INTEGER;
+	}
+
+	Value start = arguments.count > 1 ? arguments[0] : Value(0LL);
+	Value stop = arguments.count > 1 ? arguments[1] : arguments[0];
+	Value step = arguments.count > 2 ? arguments[2] : Value(1LL);
+	if (step.ToNumber() == 0) {
+		Fail("range", "a non-zero step");
+		return nullptr;
+	}
+
+	// Filled before it is counted, so a large range can start a collection.
+	auto array = new ValueVectorObject();
+	if (integers) {
+		long long from = start.as.integer, to = stop.as.integer, by = step.as.integer;
+		if ((to - from) / by > 0)
+			array->vector.reserve(static_cast<size_t>((to - from) / by + 1));
+		for (long long i = from; by > 0 ? i < to : i > to; i += by)
+			array->Push(Value(i));
+	}
+	else {
+		double from = start.ToNumber(), to = stop.ToNumber(), by = step.ToNumber();
+		for (long long i = 0; by > 0 ? from + i * by < to : from + i * by > to; i++)
+			array->Push(Value(from + i * by));
+	}
+	vm->NewObject(array);
+	return array;
+}
+
+static Value MakeTyped(VM* vm, ObjectType type, const char* name, Value source)
+{
+	TypedArrayObject* array;
+	if (source.IsNumeric() && source.ToInteger() >= 0) {
+		array = new TypedArrayObject(type, static_cast<int>(source.ToInteger()));
+		vm->NewObject(array);
+	}
+	else if (auto boxed = Boxed(source)) {
+		array = new TypedArrayObject(type, static_cast<int>(boxed->vector.size()));
+		vm->NewObject(array);
+		for (int i = 0; i < array->length; i++)
+			array->Set(i, boxed->vector[i]);
+	}
+	else if (auto typed = Typed(source)) {
+		array = new TypedArrayObject(type, typed->length);
+		vm->NewObject(array);
+		for (int i = 0; i < array->length; i++)
+			array->Set(i, typed->Get(i));
+	}
+	else
+		return Fail(name, "a length or an array");
+	return Value(array);
+}
+
+static Value Float64Array(VM* vm, Value source)
+{
+	return MakeTyped(vm, OT_FLOAT64_ARRAY, "Float64Array", source);
+}
+
+static Value Int32Array(VM* vm, Value source)
+{
+	return MakeTyped(vm, OT_INT32_ARRAY, "Int32Array", source);
+}
+
+static Value Uint8Array(VM* vm, Value source)
+{
+	return MakeTyped(vm, OT_UINT8_ARRAY, "Uint8Array", source);
+}
+
+// Views elements [begin, end) of a typed array without copying them.
+static Value Slice(VM* vm, Value source, long long begin, long long end)
+{
+	auto array = Typed(source);
+	if (array == nullptr)
+		return Fail("slice", "a typed array");
+	begin = std::max(0LL, std::min<long long>(begin, array->length));
+	end = std::max(begin, std::min<long long>(end, array->length));
+
+	auto slice = new TypedArrayObject(array, static_cast<int>(begin), static_cast<int>(end));
+	vm->NewObject(slice);
+	return Value(slice);
+}
+
+void BindIntrinsics(VM& vm)
+{
+	vm.Bind("sum", Sum);
+	vm.Bind("min", Min);
+	vm.Bind("max", Max);
+	vm.Bind("dot", Dot);
+	vm.Bind("scale", Scale);
+	vm.Bind("map_add", MapAdd);
+	vm.Bind("sort", Sort);
+	vm.Bind("fill", Fill);
+	vm.Bind("range", Range);
+
+	vm.Bind("Float64Array", Float64Array);
+	vm.Bind("Int32Array", Int32Array);
+	vm.Bind("Uint8Array", Uint8Array);
+	vm.Bind("slice", Slice);
+}
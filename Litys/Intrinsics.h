@@ -0,0 +1,10 @@
+#ifndef INTRINSICS_H
+#define INTRINSICS_H
+
+#include "VM.h"
+
+// Binds the array intrinsics: sum, min, max, dot, scale, map_add, sort,
+// fill and range, and the typed array constructors with slice.
+void BindIntrinsics(VM& vm);
+
+#endif
@@ -0,0 +1,290 @@
+#include <iostream>
+#include <algorithm>
+#include <chrono>
+
+#include "Isolate.h"
+#include "Native.h"
+
+ConstantPool::ConstantPool(Assembly& assembly)
+{
+	for (auto& i : assembly.operations) {
+		if (i.code != OP_PUSH_STRING || strings.count(i.value.as.c_str) != 0)
+			continue;
+		auto string = new StringObject(i.value.as.c_str);
+		string->constant = true;
+		string->gc_info.shared = true;
+		strings[i.value.as.c_str] = string;
+	}
+}
+
+ConstantPool::~ConstantPool()
+{
+	for (auto i : strings)
+		delete i.second;
+}
+
+StringObject* ConstantPool::Find(const char* cstr)
+{
+	auto found = strings.find(cstr);
+	return found != strings.end() ? found->second : nullptr;
+}
+
+IsolatePool::IsolatePool(Assembly& assembly, int threads, function<void(VM&)> setup)
+	: assembly(assembly), constants(assembly), setup(setup), threads(threads) {}
+
+IsolatePool::~IsolatePool()
+{
+	{
+		lock_guard<mutex> guard(lock);
+		stopping = true;
+	}
+	ready.notify_all();
+	for (auto& i : workers)
+		i.join();
+}
+
+future<string> IsolatePool::Submit(const string& entry, const string& argument)
+{
+	auto task = make_shared<packaged_task<string()>>([this, entry, argument]() { return Execute(entry, argument); });
+	auto result = task->get_future();
+	Enqueue([task]() { (*task)(); });
+	return result;
+}
+
+future<Packet> IsolatePool::Submit(function<Packet(VM&)> task)
+{
+	auto job = make_shared<packaged_task<Packet()>>([this, task]() {
+		auto vm = Acquire();
+		Value* top = vm->pointer;
+		Packet result = task(*vm);
+		vm->pointer = top;
+		Release(move(vm));
+		return result;
+	});
+	auto result = job->get_future();
+	Enqueue([job]() { (*job)(); });
+	return result;
+}
+
+Packet IsolatePool::Wait(future<Packet>& result)
+{
+	while (result.wait_for(chrono::seconds(0)) != future_status::ready)
+		if (!RunPending())
+			result.wait_for(chrono::milliseconds(1));
+	return result.get();
+}
+
+bool IsolatePool::RunPending()
+{
+	function<void()> task;
+	{
+		lock_guard<mutex> guard(lock);
+		if (tasks.empty())
+			return false;
+		task = move(tasks.front());
+		tasks.pop();
+	}
+	task();
+	return true;
+}
+
+int IsolatePool::Threads()
+{
+	return threads;
+}
+
+void IsolatePool::Enqueue(function<void()> task)
+{
+	{
+		lock_guard<mutex> guard(lock);
+		tasks.push(move(task));
+		if (workers.empty())
+			for (int i = 0; i < threads; i++)
+				workers.emplace_back(&IsolatePool::Work, this);
+	}
+	ready.notify_one();
+}
+
+void IsolatePool::Work()
+{
+	for (;;) {
+		function<void()> task;
+		{
+			unique_lock<mutex> guard(lock);
+			ready.wait(guard, [this]() { return stopping || !tasks.empty(); });
+			if (tasks.empty())
+				return;
+			task = move(tasks.front());
+			tasks.pop();
+		}
+		task();
+	}
+}
+
+// An idle isolate, or a new one once its top level has run.
+unique_ptr<VM> IsolatePool::Acquire()
+{
+	{
+		lock_guard<mutex> guard(lock);
+		if (!idle.empty()) {
+			auto vm = move(idle.back());
+			idle.pop_back();
+			return vm;
+		}
+	}
+	auto vm = make_unique<VM>(assembly, &constants);
+	vm->isolates = this;
+	setup(*vm);
+	vm->Add("isolated", Value(true));
+	vm->Run();
+	vm->output.Flush();
+	return vm;
+}
+
+void IsolatePool::Release(unique_ptr<VM> vm)
+{
+	vm->output.Flush();
+	lock_guard<mutex> guard(lock);
+	idle.push_back(move(vm));
+}
+
+// Global function of an isolate, nullptr with an error when there is none.
+static FunctionObject* Entry(VM& vm, const string& name)
+{
+	auto found = vm.globals.find(name.c_str());
+	if (found == vm.globals.end() || found->second.type != V_OBJECT || found->second.as.object->type != OT_FUNCTION) {
+		cout << "Error: isolate entry '" << name << "' is not a global function." << endl;
+		return nullptr;
+	}
+	return static_cast<FunctionObject*>(found->second.as.object);
+}
+
+string IsolatePool::Execute(const string& entry, const string& argument)
+{
+	auto vm = Acquire();
+	std::string result;
+	auto function = Entry(*vm, entry);
+	if (function != nullptr) {
+		Value* top = vm->pointer;
+		auto string = new StringObject(argument.c_str());
+		vm->NewObject(string);
+		vm->Push(string);
+		function->Call(Value(), 1);
+		if (vm->pointer > top)
+			result = vm->pointer->ToString();
+		vm->pointer = top;
+	}
+	Release(move(vm));
+	return result;
+}
+
+// Name a function is bound to in the globals, the only way an isolate can
+// find the same function in its own heap.
+static const char* GlobalName(VM* vm, Value function)
+{
+	for (auto& i : vm->globals)
+		if (i.second.type == V_OBJECT && i.second.as.object == function.as.object)
+			return i.first;
+	return nullptr;
+}
+
+// Runs entry(arguments...) in an isolate of its own, which can talk back
+// only through channels passed to it.
+static void Spawn(VM* vm, string entry, Arguments arguments)
+{
+	if (vm->isolates == nullptr) {
+		cout << "Error: spawn needs an isolate pool." << endl;
+		return;
+	}
+	auto packet = make_shared<Packet>();
+	for (int i = 0; i < arguments.count; i++) {
+		if (!packet->Add(arguments[i], false)) {
+			cout << "Error: spawn cannot transfer a " << packet->Refused() << "." << endl;
+			return;
+		}
+	}
+	vm->isolates->Submit([entry, packet](VM& vm) {
+		auto function = Entry(vm, entry);
+		if (function != nullptr) {
+			Value* top = vm.pointer;
+			function->Call(Value(), packet->Unpack(&vm));
+			vm.pointer = top;
+		}
+		return Packet();
+	});
+}
+
+// Splits array into a chunk per worker; each isolate calls function on
+// the elements of its chunk and sends the results back as one array.
+static Value ParallelMap(VM* vm, Value function, ValueVectorObject* array)
+{
+	const char* name = function.type == V_OBJECT && function.as.object->type == OT_FUNCTION ? GlobalName(vm, function) : nullptr;
+	if (name == nullptr) {
+		cout << "Error: parallel_map expects a global function." << endl;
+		return Value();
+	}
+	if (vm->isolates == nullptr) {
+		cout << "Error: parallel_map needs an isolate pool." << endl;
+		return Value();
+	}
+
+	int size = static_cast<int>(array->vector.size());
+	int chunks = max(min(vm->isolates->Threads(), size), 1);
+	string entry = name;
+	vector<future<Packet>> results;
+	vector<int> sizes;
+	for (int i = 0; i < chunks; i++) {
+		int begin = static_cast<int>(static_cast<long long>(size) * i / chunks);
+		int end = static_cast<int>(static_cast<long long>(size) * (i + 1) / chunks);
+		auto packet = make_shared<Packet>();
+		for (int j = begin; j < end; j++) {
+			if (!packet->Add(array->vector[j], false)) {
+				cout << "Error: parallel_map cannot transfer a " << packet->Refused() << "." << endl;
+				return Value();
+			}
+		}
+		sizes.push_back(end - begin);
+		results.push_back(vm->isolates->Submit([entry, packet](VM& vm) {
+			Packet result;
+			auto function = Entry(vm, entry);
+			if (function == nullptr)
+				return result;
+
+			Value* base = vm.pointer + 1;
+			int count = packet->Unpack(&vm);
+			auto mapped = new ValueVectorObject();
+			vm.NewObject(mapped);
+			vm.Push(mapped);
+			for (int i = 0; i < count; i++) {
+				Value* top = vm.pointer;
+				vm.Push(base[i]);
+				function->Call(Value(), 1);
+				mapped->Push(vm.pointer > top ? *vm.pointer : Value());
+				vm.pointer = top;
+			}
+			result.Add(mapped, true);
+			return result;
+		}));
+	}
+
+	auto mapped = new ValueVectorObject();
+	vm->NewObject(mapped);
+	vm->Push(mapped);
+	for (int i = 0; i < chunks; i++) {
+		Packet result = vm->isolates->Wait(results[i]);
+		if (result.Unpack(vm) == 0) {
+			for (int j = 0; j < sizes[i]; j++)
+				mapped->Push(Value());
+			continue;
+		}
+		for (auto& j : static_cast<ValueVectorObject*>(vm->Pop().as.object)->vector)
+			mapped->Push(j);
+	}
+	return vm->Pop();
+}
+
+void BindIsolates(VM& vm)
+{
+	vm.Bind("spawn", Spawn);
+	vm.Bind("parallel_map", ParallelMap);
+}
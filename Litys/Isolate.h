@@ -0,0 +1,79 @@
+#ifndef ISOLATE_H
+#define ISOLATE_H
+
+#include <string>
+#include <map>
+#include <vector>
+#include <queue>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <future>
+#include <functional>
+#include <memory>
+
+#include "VM.h"
+#include "Object.h"
+#include "Channel.h"
+
+// String literals of an assembly, made once before any isolate starts and
+// only read afterwards. Isolates intern literals from here instead of each
+// allocating its own copies.
+class ConstantPool {
+public:
+	ConstantPool(Assembly& assembly);
+	~ConstantPool();
+	StringObject* Find(const char* cstr);
+private:
+	map<string, StringObject*> strings;
+};
+
+// Fixed set of worker threads running isolates: VMs of their own over the
+// same assembly that run the top level of the script once and then take
+// task after task, each calling one global function. Like a worker
+// process, an isolate keeps the globals earlier tasks left behind. Idle
+// isolates wait in a list, so there is about one per worker, more only
+// while a waiting isolate runs queued tasks itself. Isolates share only
+// the code and the constant pool, which nobody writes to, so nothing is
+// locked while they run; values cross between them only as packets.
+// Workers are started by the first task. The global isolated is true in
+// isolates, so the top level of a script can tell it is not the main
+// program.
+class IsolatePool {
+public:
+	IsolatePool(Assembly& assembly, int threads, function<void(VM&)> setup);
+	~IsolatePool();
+	// Calls entry(argument) in an idle isolate, the future holds the
+	// result converted to a string.
+	future<string> Submit(const string& entry, const string& argument);
+	// Runs task in an idle isolate.
+	future<Packet> Submit(function<Packet(VM&)> task);
+	// Runs queued tasks while waiting, so an isolate waiting for others
+	// never holds up the worker they need.
+	Packet Wait(future<Packet>& result);
+	// Runs one queued task on the calling thread, false when none is
+	// queued.
+	bool RunPending();
+	int Threads();
+private:
+	Assembly& assembly;
+	ConstantPool constants;
+	function<void(VM&)> setup;
+	int threads;
+	vector<thread> workers;
+	queue<function<void()>> tasks;
+	mutex lock;
+	condition_variable ready;
+	bool stopping = false;
+	vector<unique_ptr<VM>> idle;
+	void Enqueue(function<void()> task);
+	void Work();
+	unique_ptr<VM> Acquire();
+	void Release(unique_ptr<VM> vm);
+	string Execute(const string& entry, const string& argument);
+};
+
+// Binds spawn and parallel_map, which run on the pool of the VM.
+void BindIsolates(VM& vm);
+
+#endif
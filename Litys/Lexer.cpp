@@ -24,6 +24,8 @@ map<string, TokenType> keywords = {
     { "from",  T_FROM },
     { "load",  T_LOAD },
     { "as",  T_AS },
+    { "yield",  T_YIELD },
+    { "resume",  T_RESUME },
 };
 
 
@@ -105,6 +107,9 @@ void Lexer::ParseToken() {
     case '%':
         tokens.push_back(T_PERCENT);
         break;
+    case '#':
+        tokens.push_back(T_HASH);
+        break;
     case '!':
         tokens.push_back(Match('=') ? T_BANG_EQUAL : T_BANG);
         break;
@@ -193,7 +198,8 @@ void Lexer::Number()
             Advance();
     }
 
-    tokens.push_back(Token(T_NUMBER, stod(source.substr(start, current - start))));
+    const char* literal = source.data() + start;
+    tokens.push_back(Token(T_NUMBER, ParseNumber(literal, literal + (current - start))));
 }
 
 void Lexer::Identifier()
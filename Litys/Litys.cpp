@@ -1,68 +1,108 @@
 ﻿#include <iostream>
 #include <string>
+#include <cstdio>
+#include <algorithm>
 #include <fstream>
 #include <streambuf>
 #include <chrono>
 #include "Lexer.h"
 #include "Parser.h"
 #include "Object.h"
+#include "Native.h"
+#include "Intrinsics.h"
+#include "File.h"
+#include "Isolate.h"
+#include "Coroutine.h"
 
 using namespace std;
 
-int FuncPrint(VM* vm) {
-    for (int i = 0; i < vm->GetParametersCount(); i++)
-        cout << vm->GetParameter(i).ToString() << ' ';
-    cout << endl;
-    return 0;
+void FuncPrint(VM* vm, Arguments arguments) {
+    string& buffer = vm->output.buffer;
+    size_t from = buffer.size();
+    for (int i = 0; i < arguments.count; i++) {
+        arguments[i].AppendTo(buffer);
+        buffer += ' ';
+    }
+    buffer += '\n';
+    vm->output.Written(from);
+}
+
+void FuncWrite(VM* vm, Arguments arguments) {
+    string& buffer = vm->output.buffer;
+    size_t from = buffer.size();
+    for (int i = 0; i < arguments.count; i++)
+        arguments[i].AppendTo(buffer);
+    vm->output.Written(from);
+}
+
+void FuncFlush(VM* vm) {
+    vm->output.Flush();
+}
+
+void FuncFlushPolicy(VM* vm, string policy) {
+    if (policy == "line")
+        vm->output.policy = FLUSH_LINE;
+    else if (policy == "block")
+        vm->output.policy = FLUSH_BLOCK;
+    else if (policy == "explicit")
+        vm->output.policy = FLUSH_EXPLICIT;
+    else
+        cout << "Error: flush_policy expects \"line\", \"block\" or \"explicit\"." << endl;
 }
 
-int FuncInput(VM* vm) {
+string FuncInput() {
     std::string str;
     std::getline(std::cin, str);
-    auto obj = new StringObject(str.c_str());
-    vm->Push(obj);
-    vm->NewObject(obj);
-    return 1;
+    return str;
 }
 
-int FuncMathSin(VM* vm) {
-    vm->Push(sin(vm->GetParameter(0).as.number));
-    return 1;
+double FuncMathSin(double x) {
+    return sin(x);
 }
 
-int FuncMathPow(VM* vm) {
-    vm->Push(pow(vm->GetParameter(0).as.number, vm->GetParameter(1).as.number));
-    return 1;
+double FuncMathPow(double x, double y) {
+    return pow(x, y);
 }
 
-int FuncNow(VM* vm) {
-    vm->Push((double)chrono::high_resolution_clock::now().time_since_epoch().count());
-    return 1;
+double FuncNow() {
+    return (double)chrono::high_resolution_clock::now().time_since_epoch().count();
 }
 
-int FuncString(VM* vm) {
+string FuncString(Arguments arguments) {
     string r;
-    for (int i = 0; i < vm->GetParametersCount(); i++)
-        r += vm->GetParameter(i).ToString();
-    auto obj = new StringObject(r.c_str());
-    vm->NewObject(obj);
-    vm->Push(obj);
-    return 1;
+    for (int i = 0; i < arguments.count; i++)
+        arguments[i].AppendTo(r);
+    return r;
 }
 
-int FuncInt(VM* vm) {
-    vm->Push((int)round(stod(vm->GetParameter(0).ToString().c_str())));
-    return 1;
+// Numbers pass through, strings are parsed in place.
+Value ParseValue(Value value) {
+    if (value.IsNumeric())
+        return value;
+    if (value.type == V_OBJECT && value.as.object->type == OT_STRING) {
+        auto string = static_cast<StringObject*>(value.as.object);
+        return ParseNumber(string->Data(), string->Data() + string->Length());
+    }
+    std::string text = value.ToString();
+    return ParseNumber(text.data(), text.data() + text.size());
+}
+
+Value FuncInt(Value value) {
+    Value number = ParseValue(value);
+    if (number.type == V_NUMBER)
+        return Value(llround(number.as.number));
+    return number;
 }
 
-int FuncNumber(VM* vm) {
-    vm->Push(stod(vm->GetParameter(0).ToString().c_str()));
-    return 1;
+Value FuncNumber(Value value) {
+    Value number = ParseValue(value);
+    if (number.type == V_INTEGER)
+        return Value(static_cast<double>(number.as.integer));
+    return number;
 }
 
-int FuncCG(VM* vm) {
+void FuncCG(VM* vm) {
     vm->CollectGarbage();
-    return 1;
 }
 
 int factorial(int x) {
@@ -80,6 +120,100 @@ int fib(int n) {
     return fib(n - 1) + fib(n - 2);
 }
 
+// Calls entry with one record, dropping whatever the call leaves behind.
+void CallRecord(VM& vm, FunctionObject* entry, Value record) {
+    Value* top = vm.pointer;
+    vm.Push(record);
+    entry->Call(Value(), 1);
+    vm.pointer = top;
+}
+
+// Runs entry once per line of the records file, or of stdin when there is
+// none. The script is compiled and its top level run only once; lines of
+// a file are views into its mapping.
+void RunBatch(VM& vm, const char* name, const char* path) {
+    Value entry = vm.globals[name];
+    if (entry.type != V_OBJECT || entry.as.object->type != OT_FUNCTION) {
+        cout << "Error: batch entry '" << name << "' is not a global function." << endl;
+        return;
+    }
+    auto function = static_cast<FunctionObject*>(entry.as.object);
+
+    if (path != nullptr) {
+        auto file = new MappedFileObject();
+        if (!file->Open(path)) {
+            delete file;
+            cout << "Error: cannot map file '" << path << "'." << endl;
+            return;
+        }
+        vm.NewObject(file);
+        vm.Push(file);
+        auto lines = new SliceIteratorObject(Value(file), '\n');
+        vm.NewObject(lines);
+        vm.Push(lines);
+        for (Value record = lines->Next(&vm); record.type != V_NIL; record = lines->Next(&vm))
+            CallRecord(vm, function, record);
+        vm.pointer -= 2;
+    }
+    else {
+        // Records come in blocks, input() prompts are not flushed for.
+        cin.tie(nullptr);
+        string pending;
+        char block[64 * 1024];
+        size_t count;
+        while ((count = fread(block, 1, sizeof(block), stdin)) > 0 || !pending.empty()) {
+            pending.append(block, count);
+            size_t start = 0;
+            for (size_t end; (end = pending.find('\n', start)) != string::npos || (count == 0 && start < pending.size()); start = end + 1) {
+                if (end == string::npos)
+                    end = pending.size();
+                size_t length = end - start;
+                if (length > 0 && pending[start + length - 1] == '\r')
+                    length--;
+                auto record = new StringObject(make_shared<string>(pending, start, length), length);
+                vm.NewObject(record);
+                CallRecord(vm, function, record);
+            }
+            pending.erase(0, min(start, pending.size()));
+            if (count == 0)
+                break;
+        }
+    }
+    vm.output.Flush();
+}
+
+// Natives every VM gets, the main one and each isolate.
+void BindNatives(VM& vm) {
+    vm.Bind("print", FuncPrint);
+    vm.Bind("write", FuncWrite);
+    vm.Bind("flush", FuncFlush);
+    vm.Bind("flush_policy", FuncFlushPolicy);
+    vm.Bind("input", FuncInput);
+    vm.Bind("sin", FuncMathSin);
+    vm.Bind("pow", FuncMathPow);
+    vm.Bind("now", FuncNow);
+    vm.Bind("string", FuncString);
+    vm.Bind("int", FuncInt);
+    vm.Bind("number", FuncNumber);
+
+    vm.Bind("collect_garbage", FuncCG);
+    BindIntrinsics(vm);
+    BindFiles(vm);
+    BindChannels(vm);
+    BindIsolates(vm);
+    BindCoroutines(vm);
+}
+
+// Calls entry(i) for i below count, each in its own isolate, and prints
+// the results in order.
+void RunIsolates(IsolatePool& pool, const char* entry, int count) {
+    vector<future<string>> results;
+    for (int i = 0; i < count; i++)
+        results.push_back(pool.Submit(entry, to_string(i)));
+    for (auto& i : results)
+        cout << i.get() << endl;
+}
+
 int main(int argc, char* argv[])
 {
     ifstream t(argv[1]);
@@ -117,21 +251,28 @@ int main(int argc, char* argv[])
         //         k++;
         // }
             
-        VM vm(assembly);
+        // litys script.lts --isolates threads entry count
+        bool isolated = argc > 5 && string(argv[2]) == "--isolates";
+        int threads = isolated ? atoi(argv[3]) : static_cast<int>(thread::hardware_concurrency());
+        IsolatePool isolates(assembly, max(threads, 1), BindNatives);
+        if (isolated) {
+            RunIsolates(isolates, argv[4], atoi(argv[5]));
+            delete result;
+            return 0;
+        }
 
-        vm.Add("print", new CFunctionObject(FuncPrint));
-        vm.Add("input", new CFunctionObject(FuncInput));
-        vm.Add("sin", new CFunctionObject(FuncMathSin));
-        vm.Add("pow", new CFunctionObject(FuncMathPow));
-        vm.Add("now", new CFunctionObject(FuncNow));
-        vm.Add("string", new CFunctionObject(FuncString));
-        vm.Add("int", new CFunctionObject(FuncInt));
-        vm.Add("number", new CFunctionObject(FuncNumber));
-
-        vm.Add("collect_garbage", new CFunctionObject(FuncCG));
+        VM vm(assembly);
+        vm.output.Tie();
+        vm.isolates = &isolates;
+        BindNatives(vm);
+        vm.Add("isolated", Value(false));
 
         vm.Run();
 
+        // litys script.lts --batch entry [records]
+        if (argc > 3 && string(argv[2]) == "--batch")
+            RunBatch(vm, argv[3], argc > 4 ? argv[4] : nullptr);
+
         delete result;
     }
     else
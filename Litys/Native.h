@@ -0,0 +1,215 @@
+#ifndef NATIVE_H
+#define NATIVE_H
+
+#include <string>
+#include <iostream>
+#include <utility>
+#include <type_traits>
+
+#include "Object.h"
+
+// Binds plain C++ functions as natives. Argument and return types are
+// deduced at compile time: the generated thunk checks every argument
+// once, reads them in place on the stack, drops them all at once and
+// pushes the boxed result.
+
+// Remaining arguments of a variadic native, still on the VM stack.
+struct Arguments {
+	Value* values;
+	int count;
+	Value& operator[](int index) { return values[index]; }
+};
+
+template <typename T>
+struct NativeType;
+
+template <>
+struct NativeType<double> {
+	static const int arguments = 1;
+	static const char* Name() { return "number"; }
+	static bool Check(Value* value) { return value->IsNumeric(); }
+	static double Get(VM*, Value* values, int) { return values->ToNumber(); }
+	static Value Box(VM*, double result) { return Value(result); }
+};
+
+template <>
+struct NativeType<long long> {
+	static const int arguments = 1;
+	static const char* Name() { return "number"; }
+	static bool Check(Value* value) { return value->IsNumeric(); }
+	static long long Get(VM*, Value* values, int) { return values->ToInteger(); }
+	static Value Box(VM*, long long result) { return Value(result); }
+};
+
+template <>
+struct NativeType<bool> {
+	static const int arguments = 1;
+	static const char* Name() { return "bool"; }
+	static bool Check(Value* value) { return value->type == V_BOOL; }
+	static bool Get(VM*, Value* values, int) { return values->as.boolean; }
+	static Value Box(VM*, bool result) { return Value(result); }
+};
+
+template <>
+struct NativeType<std::string> {
+	static const int arguments = 1;
+	static const char* Name() { return "string"; }
+	static bool Check(Value* value) { return value->type == V_OBJECT && value->as.object->type == OT_STRING; }
+	static std::string Get(VM*, Value* values, int) { return values->ToString(); }
+
+	static Value Box(VM* vm, const std::string& result)
+	{
+		auto object = new StringObject(result.c_str());
+		vm->NewObject(object);
+		return Value(object);
+	}
+};
+
+template <>
+struct NativeType<Value> {
+	static const int arguments = 1;
+	static const char* Name() { return "value"; }
+	static bool Check(Value*) { return true; }
+	static Value Get(VM*, Value* values, int) { return *values; }
+	static Value Box(VM*, Value result) { return result; }
+};
+
+template <>
+struct NativeType<ValueVectorObject*> {
+	static const int arguments = 1;
+	static const char* Name() { return "array"; }
+	static bool Check(Value* value) { return value->type == V_OBJECT && value->as.object->type == OT_ARRAY; }
+	static ValueVectorObject* Get(VM*, Value* values, int) { return static_cast<ValueVectorObject*>(values->as.object); }
+	static Value Box(VM*, ValueVectorObject* result) { return result != nullptr ? Value(result) : Value(); }
+};
+
+template <>
+struct NativeType<VM*> {
+	static const int arguments = 0;
+	static bool Check(Value*) { return true; }
+	static VM* Get(VM* vm, Value*, int) { return vm; }
+};
+
+template <>
+struct NativeType<Arguments> {
+	static const int arguments = 0;
+	static bool Check(Value*) { return true; }
+	static Arguments Get(VM*, Value* values, int count) { return Arguments{ values, count }; }
+};
+
+template <typename T>
+using NativeTypeOf = NativeType<typename std::decay<T>::type>;
+
+// Stack offset of the parameter at index, VM* and Arguments take no slot.
+template <typename... Args>
+constexpr int NativeOffset(int index)
+{
+	const int sizes[] = { NativeTypeOf<Args>::arguments..., 0 };
+	int offset = 0;
+	for (int i = 0; i < index; i++)
+		offset += sizes[i];
+	return offset;
+}
+
+template <typename... Args>
+constexpr bool NativeVariadic()
+{
+	const bool variadic[] = { std::is_same<typename std::decay<Args>::type, Arguments>::value..., false };
+	for (auto i : variadic)
+		if (i)
+			return true;
+	return false;
+}
+
+template <typename R>
+struct NativeReturn {
+	template <typename F>
+	static void Call(VM* vm, int count, F function)
+	{
+		Value result = NativeTypeOf<R>::Box(vm, function());
+		vm->pointer -= count;
+		vm->Push(result);
+	}
+
+	// A failed call leaves nil where the result would have been.
+	static void Fail(VM* vm, int count)
+	{
+		vm->pointer -= count;
+		vm->Push(Value());
+	}
+};
+
+// Returning nothing leaves nil, as a function without a return value does.
+template <>
+struct NativeReturn<void> {
+	template <typename F>
+	static void Call(VM* vm, int count, F function)
+	{
+		function();
+		vm->pointer -= count;
+		vm->Push(Value());
+	}
+
+	static void Fail(VM* vm, int count)
+	{
+		vm->pointer -= count;
+		vm->Push(Value());
+	}
+};
+
+template <typename R, typename... Args>
+class NativeObject : public Object {
+public:
+	const char* name;
+	R(*function)(Args...);
+
+	NativeObject(const char* name, R(*function)(Args...)) : name(name), function(function) { type = OT_IFUNCTION; }
+
+	virtual void Operate(VM* vm, Operation operation)
+	{
+		if (operation.code == OP_CALL)
+			Call(vm, static_cast<int>(operation.value.as.integer), std::index_sequence_for<Args...>());
+		else
+			Object::Operate(vm, operation);
+	}
+
+	virtual int Size()
+	{
+		return sizeof(NativeObject);
+	}
+
+private:
+	template <size_t... I>
+	void Call(VM* vm, int count, std::index_sequence<I...>)
+	{
+		Value* values = vm->pointer - count + 1;
+		const int arity = NativeOffset<Args...>(sizeof...(Args));
+
+		if (NativeVariadic<Args...>() ? count < arity : count != arity) {
+			std::cout << "Error: " << name << " expects " << arity << " arguments, got " << count << "." << std::endl;
+			return NativeReturn<R>::Fail(vm, count);
+		}
+
+		const bool checks[] = { NativeTypeOf<Args>::Check(values + NativeOffset<Args...>(I))..., true };
+		for (size_t i = 0; i < sizeof...(Args); i++)
+		{
+			if (!checks[i]) {
+				std::cout << "Error: bad argument " << NativeOffset<Args...>(static_cast<int>(i)) + 1 << " to " << name << "." << std::endl;
+				return NativeReturn<R>::Fail(vm, count);
+			}
+		}
+
+		auto f = function;
+		NativeReturn<R>::Call(vm, count, [&]() {
+			return f(NativeTypeOf<Args>::Get(vm, values + NativeOffset<Args...>(I), count - NativeOffset<Args...>(I))...);
+		});
+	}
+};
+
+template <typename R, typename... Args>
+void VM::Bind(const char* name, R(*function)(Args...))
+{
+	Add(name, new NativeObject<R, Args...>(name, function));
+}
+
+#endif
@@ -1,6 +1,8 @@
 #include <sstream>
 #include <string>
+#include <cstring>
 #include <iostream>
+#include <cstdint>
 
 #include "Object.h"
 
@@ -23,6 +25,11 @@ void Object::Operate(VM* vm, Operation operation)
 	case OP_NOT_EQUAL:
 		vm->Push(Value(this != vm->Pop().as.object));
 		break;
+	case OP_CALL:
+		// Calling what cannot be called still leaves one value.
+		vm->pointer -= operation.value.as.integer;
+		vm->Push(Value());
+		break;
 	default:
 		break;
 	}
@@ -40,9 +47,24 @@ string Object::ToString()
 	return "<object at " + str + ">";
 }
 
-StringObject::StringObject(const char* cstr)
+void Object::AppendTo(string& buffer)
+{
+	buffer += ToString();
+}
+
+StringObject::StringObject(const char* cstr) : buffer(make_shared<string>(cstr))
+{
+	length = buffer->size();
+	type = OT_STRING;
+}
+
+StringObject::StringObject(shared_ptr<string> buffer, size_t length) : buffer(buffer), length(length)
+{
+	type = OT_STRING;
+}
+
+StringObject::StringObject(Object* source, const char* view, size_t length) : view(view), source(source), length(length)
 {
-	Append(std::string(cstr));
 	type = OT_STRING;
 }
 
@@ -51,31 +73,154 @@ void StringObject::Operate(VM* vm, Operation operation)
 	switch (operation.code)
 	{
 	case OP_ADD:
-		Append(vm->Pop().ToString());
-		vm->Push(Value(this));
+	{
+		auto string = Concat(vm, vm->Peek());
+		vm->Pop();
+		vm->Push(Value(string));
+	}
 		break;
 	default:
 		Object::Operate(vm, operation);
 	}
 }
 
-void StringObject::Append(string string)
+void StringObject::MarkObjects(VM* vm)
+{
+	if (source != nullptr)
+		vm->MarkObject(source);
+}
+
+int StringObject::Size()
+{
+	return static_cast<int>(sizeof(StringObject) + (view == nullptr ? length : 0));
+}
+
+const char* StringObject::Data()
+{
+	return view != nullptr ? view : buffer->data();
+}
+
+size_t StringObject::Length()
+{
+	return length;
+}
+
+// The operands are read before the result is allocated, a collection
+// may free them but the buffer is held here.
+StringObject* StringObject::Concat(VM* vm, Value value)
+{
+	auto shared = buffer;
+	if (shared == nullptr || constant || shared->size() != length)
+		shared = make_shared<string>(Data(), length);
+
+	value.AppendTo(*shared);
+
+	auto result = new StringObject(shared, shared->size());
+	vm->NewObject(result);
+	return result;
+}
+
+void StringObject::Append(const string& string)
+{
+	Own();
+	buffer->append(string);
+	length = buffer->size();
+}
+
+void StringObject::Set(int index, char c)
+{
+	Own();
+	(*buffer)[index] = c;
+}
+
+// Copies the characters before an in place change when others see them.
+void StringObject::Own()
+{
+	if (buffer == nullptr || buffer.use_count() > 1 || buffer->size() != length)
+		buffer = make_shared<string>(Data(), length);
+	view = nullptr;
+	source = nullptr;
+}
+
+const char* metamethod2string[] = {
+	"__add", "__sub", "__mul", "__div", "__mod", "__idiv", "__neg",
+	"__eq", "__ne", "__gt", "__ge", "__lt", "__le",
+	"__radd", "__rsub", "__rmul", "__rdiv", "__rmod", "__ridiv",
+	"__index", "__call", "__len", "__to_string",
+};
+
+int MetamethodOf(OperationCode code)
+{
+	switch (code)
+	{
+	case OP_ADD: return MM_ADD;
+	case OP_SUBTRACT: return MM_SUBTRACT;
+	case OP_MULTIPLY: return MM_MULTIPLY;
+	case OP_DIVIDE: return MM_DIVIDE;
+	case OP_MOD: return MM_MOD;
+	case OP_DIV: return MM_DIV;
+	case OP_NEGATE: return MM_NEGATE;
+	case OP_EQUAL: return MM_EQUAL;
+	case OP_NOT_EQUAL: return MM_NOT_EQUAL;
+	case OP_GREATER: return MM_GREATER;
+	case OP_GREATER_EQUAL: return MM_GREATER_EQUAL;
+	case OP_LESS: return MM_LESS;
+	case OP_LESS_EQUAL: return MM_LESS_EQUAL;
+	case OP_CALL: return MM_CALL;
+	default: return -1;
+	}
+}
+
+// Metamethod of the right operand for a binary operation whose left one
+// has none: the reflected form of arithmetic, and the mirrored comparison,
+// since a < b holds when b > a does.
+int ReflectedMetamethodOf(OperationCode code)
+{
+	switch (code)
+	{
+	case OP_ADD: return MM_RADD;
+	case OP_SUBTRACT: return MM_RSUBTRACT;
+	case OP_MULTIPLY: return MM_RMULTIPLY;
+	case OP_DIVIDE: return MM_RDIVIDE;
+	case OP_MOD: return MM_RMOD;
+	case OP_DIV: return MM_RDIV;
+	case OP_EQUAL: return MM_EQUAL;
+	case OP_NOT_EQUAL: return MM_NOT_EQUAL;
+	case OP_GREATER: return MM_LESS;
+	case OP_GREATER_EQUAL: return MM_LESS_EQUAL;
+	case OP_LESS: return MM_GREATER;
+	case OP_LESS_EQUAL: return MM_GREATER_EQUAL;
+	default: return -1;
+	}
+}
+
+static int MetamethodOf(const char* name)
 {
-	for (auto j : string)
-		vector.push_back((int)j);
+	if (name[0] != '_' || name[1] != '_')
+		return -1;
+	for (int i = 0; i < MM_COUNT; i++)
+		if (strcmp(name, metamethod2string[i]) == 0)
+			return i;
+	return -1;
 }
 
 ValueTableObject::ValueTableObject() { type = OT_TABLE; }
 
 void ValueTableObject::Operate(VM* vm, Operation operation)
 {
-	if (operation.code == OP_ADD) {
-		auto value = GetValue("__add");
-		if (value.type == V_OBJECT && value.as.object->type == OT_FUNCTION) {
-			FunctionObject* object = static_cast<FunctionObject*>(value.as.object);
-			object->Call(this);
-		}
+	int method = MetamethodOf(operation.code);
+	int arguments_count = operation.code == OP_CALL ? static_cast<int>(operation.value.as.integer)
+		: operation.code == OP_NEGATE ? 0 : 1;
+
+	if (method >= 0 && CallMetamethod(vm, static_cast<Metamethod>(method), arguments_count))
+		return;
+
+	if (operation.code == OP_CALL) {
+		vm->pointer -= arguments_count;
+		vm->Push(Value());
 	}
+	else
+		Object::Operate(vm, operation);
 }
 
 void ValueTableObject::MarkObjects(VM* vm)
@@ -84,60 +229,244 @@ void ValueTableObject::MarkObjects(VM* vm)
 		vm->MarkObject(meta);
 	for (auto &i : table)
 		vm->MarkValue(i.second);
+	for (auto& i : array)
+		vm->MarkValue(i);
+	for (auto& i : hash) {
+		vm->MarkValue(i.first);
+		vm->MarkValue(i.second);
+	}
 }
 
 int ValueTableObject::Size()
 {
-	return sizeof(ValueTableObject) + (sizeof(const char*) + sizeof(Value)) * table.size();
+	return sizeof(ValueTableObject) + (sizeof(const char*) + sizeof(Value)) * table.size()
+		+ sizeof(Value) * array.size() + sizeof(Value) * 2 * hash.size();
 }
 
 Value ValueTableObject::GetValue(const char* name)
 {
-	auto t = &table;
-	while (t != nullptr) {
-		auto r1 = t->find(name);
-		if (r1 != t->end())
-		{
+	for (auto t = this; t != nullptr; t = t->meta) {
+		auto r1 = t->table.find(name);
+		if (r1 != t->table.end())
 			return (*r1).second;
+	}
+	return Value();
+}
+
+// Storing nil removes the key, so a name set to nil no longer hides the
+// one of a meta table and takes no room.
+void ValueTableObject::SetValue(const char* name, Value value)
+{
+	if (value.type != V_NIL)
+		table[name] = value;
+	else {
+		auto found = table.find(name);
+		if (found != table.end()) {
+			string owned = found->first;
+			table.erase(found);
+			names.erase(owned);
 		}
-		else if (meta != nullptr) {
-			t = &(meta->table);
+	}
+	version++;
+
+	int method = MetamethodOf(name);
+	if (method < 0)
+		return;
+	if (value.type != V_NIL)
+		metamethods |= 1u << method;
+	else
+		metamethods &= ~(1u << method);
+}
+
+bool ValueTableObject::HasMetamethod(Metamethod method)
+{
+	unsigned mask = 0;
+	for (auto t = this; t != nullptr; t = t->meta)
+		mask |= t->metamethods;
+	return (mask & (1u << method)) != 0;
+}
+
+Value ValueTableObject::GetMetamethod(Metamethod method)
+{
+	for (auto t = this; t != nullptr; t = t->meta)
+		if (t->metamethods & (1u << method))
+			return t->table.find(metamethod2string[method])->second;
+	return Value();
+}
+
+// Enters a function metamethod in the running dispatch loop, with the
+// table as self and the operands already on the stack as arguments.
+bool ValueTableObject::CallMetamethod(VM* vm, Metamethod method, int arguments_count)
+{
+	Value value = GetMetamethod(method);
+	if (value.type != V_OBJECT || value.as.object->type != OT_FUNCTION)
+		return false;
+	vm->Invoke(static_cast<FunctionObject*>(value.as.object), this, arguments_count);
+	return true;
+}
+
+static bool StringKey(Value key)
+{
+	return key.type == V_CSTRING || (key.type == V_OBJECT && key.as.object->type == OT_STRING);
+}
+
+// Characters of a string key, read in place.
+static string_view KeyName(Value key)
+{
+	if (key.type == V_CSTRING)
+		return string_view(key.as.c_str);
+	auto string = static_cast<StringObject*>(key.as.object);
+	return string_view(string->Data(), string->Length());
+}
+
+static Value NormalizeKey(Value key)
+{
+	if (key.type == V_NUMBER && key.as.number >= -9.2e18 && key.as.number <= 9.2e18
+		&& key.as.number == static_cast<double>(static_cast<long long>(key.as.number)))
+		return Value(static_cast<long long>(key.as.number));
+	return key;
+}
+
+Value ValueTableObject::Get(Value key)
+{
+	if (StringKey(key)) {
+		string_view name = KeyName(key);
+		for (auto t = this; t != nullptr; t = t->meta) {
+			auto found = t->table.find(name);
+			if (found != t->table.end())
+				return found->second;
 		}
-		else break;
+		return Value();
+	}
+
+	key = NormalizeKey(key);
+	for (auto t = this; t != nullptr; t = t->meta) {
+		if (key.type == V_INTEGER && key.as.integer >= 0 && key.as.integer < static_cast<long long>(t->array.size()))
+			return t->array[key.as.integer];
+		auto found = t->hash.find(key);
+		if (found != t->hash.end())
+			return found->second;
 	}
 	return Value();
 }
 
+void ValueTableObject::Set(Value key, Value value)
+{
+	if (StringKey(key)) {
+		string_view name = KeyName(key);
+		auto found = table.find(name);
+		if (found != table.end())
+			SetValue(found->first, value);
+		else
+			SetValue(names.insert(string(name)).first->c_str(), value);
+		return;
+	}
+
+	key = NormalizeKey(key);
+	if (key.type == V_NIL)
+		return;
+	if (key.type == V_INTEGER && key.as.integer >= 0 && key.as.integer <= static_cast<long long>(array.size())) {
+		if (key.as.integer < static_cast<long long>(array.size())) {
+			array[key.as.integer] = value;
+			// The array part ends at its last value that is not nil.
+			while (!array.empty() && array.back().type == V_NIL)
+				array.pop_back();
+			return;
+		}
+		if (value.type == V_NIL)
+			return;
+
+		// Appending may make the next integer keys contiguous too.
+		array.push_back(value);
+		for (auto next = hash.find(Value(static_cast<long long>(array.size()))); next != hash.end();
+			next = hash.find(Value(static_cast<long long>(array.size())))) {
+			array.push_back(next->second);
+			hash.erase(next);
+		}
+		return;
+	}
+	if (value.type != V_NIL)
+		hash[key] = value;
+	else
+		hash.erase(key);
+}
+
 string ValueTableObject::ToString()
 {
-	auto value = GetValue("__to_string");
+	Value value = GetMetamethod(MM_TO_STRING);
 	if (value.type == V_OBJECT && value.as.object->type == OT_FUNCTION) {
 		auto object = static_cast<FunctionObject*>(value.as.object);
-		object->Call(this);
-		return static_cast<StringObject*>(object->vm->Pop().as.object)->ToString();
+		object->Call(this, 0);
+		return object->vm->Pop().ToString();
 	}
 	else {
 		string result = "{ ";
 		int j = 0;
+		int count = static_cast<int>(table.size() + array.size() + hash.size());
 		for (auto i : table)
 		{
 			j++;
 			string name = string(i.first);
 			string value = i.second.ToString();
-			result += "'" + name + "': " + value + (j != table.size() ? ", " : "");
+			result += "'" + name + "': " + value + (j != count ? ", " : "");
+		}
+		for (size_t i = 0; i < array.size(); i++)
+		{
+			j++;
+			result += to_string(i) + ": " + array[i].ToString() + (j != count ? ", " : "");
+		}
+		for (auto i : hash)
+		{
+			j++;
+			Value key = i.first;
+			result += key.ToString() + ": " + i.second.ToString() + (j != count ? ", " : "");
 		}
 		result += " }";
 		return result;
 	}
 }
 
+size_t ValueHash::operator()(const Value& value) const
+{
+	switch (value.type)
+	{
+	case V_INTEGER:
+		return std::hash<long long>()(value.as.integer);
+	case V_NUMBER:
+		return std::hash<double>()(value.as.number);
+	case V_BOOL:
+		return value.as.boolean ? 1 : 0;
+	default:
+		return std::hash<const void*>()(value.as.object);
+	}
+}
+
+bool ValueEqual::operator()(const Value& a, const Value& b) const
+{
+	if (a.type != b.type)
+		return false;
+	switch (a.type)
+	{
+	case V_NIL:
+		return true;
+	case V_INTEGER:
+		return a.as.integer == b.as.integer;
+	case V_NUMBER:
+		return a.as.number == b.as.number;
+	case V_BOOL:
+		return a.as.boolean == b.as.boolean;
+	default:
+		return a.as.object == b.as.object;
+	}
+}
+
 ValueVectorObject::ValueVectorObject() { type = OT_ARRAY; }
 void ValueVectorObject::Operate(VM* vm, Operation operation)
 {
 	switch (operation.code)
 	{
 	case OP_ADD:
-		vector.push_back(vm->Pop());
+		Push(vm->Pop());
 		vm->Push(Value(this));
 		break;
 	default:
@@ -146,6 +475,32 @@ void ValueVectorObject::Operate(VM* vm, Operation operation)
 	}
 }
 
+void ValueVectorObject::Push(Value value)
+{
+	Count(value, 1);
+	vector.push_back(value);
+}
+
+void ValueVectorObject::Set(int index, Value value)
+{
+	Count(vector[index], -1);
+	Count(value, 1);
+	vector[index] = value;
+}
+
+void ValueVectorObject::Count(Value value, int delta)
+{
+	if (value.type == V_NUMBER)
+		numbers += delta;
+	else if (value.type == V_INTEGER)
+		integers += delta;
+}
+
+bool ValueVectorObject::Numeric()
+{
+	return static_cast<size_t>(numbers + integers) == vector.size();
+}
+
 void ValueVectorObject::MarkObjects(VM* vm)
 {
 	for (auto i : vector)
@@ -159,58 +514,203 @@ int ValueVectorObject::Size()
 
 string ValueVectorObject::ToString()
 {
-	string result = "[";
+	string result;
+	AppendTo(result);
+	return result;
+}
+
+void ValueVectorObject::AppendTo(string& buffer)
+{
+	buffer += '[';
 	for (int i = 0; i < vector.size(); i++)
 	{
-		string object = vector[i].ToString();
+		vector[i].AppendTo(buffer);
 		if (i != vector.size() - 1)
-			object += ", ";
-		for (auto j : object)
-			result += j;
+			buffer += ", ";
 	}
-	result += "]";
-	return result;
+	buffer += ']';
 }
 
 string StringObject::ToString()
+{
+	return string(Data(), length);
+}
+
+void StringObject::AppendTo(string& buffer)
+{
+	buffer.append(Data(), length);
+}
+
+TypedArrayObject::TypedArrayObject(ObjectType type, int length) : owner(this), length(length)
+{
+	this->type = type;
+	data = new char[static_cast<size_t>(length) * ElementSize()]();
+}
+
+// Takes over elements allocated with new[], such as ones moved in from
+// another isolate.
+TypedArrayObject::TypedArrayObject(ObjectType type, char* data, int length) : owner(this), data(data), length(length)
+{
+	this->type = type;
+}
+
+TypedArrayObject::TypedArrayObject(TypedArrayObject* source, int begin, int end) : owner(source->owner), length(end - begin)
+{
+	type = source->type;
+	owner->slices++;
+	data = source->data + static_cast<size_t>(begin) * ElementSize();
+}
+
+TypedArrayObject::~TypedArrayObject()
+{
+	if (owner == this)
+		delete[] data;
+}
+
+int TypedArrayObject::ElementSize()
+{
+	switch (type)
+	{
+	case OT_FLOAT64_ARRAY:
+		return sizeof(double);
+	case OT_INT32_ARRAY:
+		return sizeof(int32_t);
+	default:
+		return sizeof(uint8_t);
+	}
+}
+
+Value TypedArrayObject::Get(int index)
+{
+	switch (type)
+	{
+	case OT_FLOAT64_ARRAY:
+		return Value(reinterpret_cast<double*>(data)[index]);
+	case OT_INT32_ARRAY:
+		return Value(static_cast<long long>(reinterpret_cast<int32_t*>(data)[index]));
+	default:
+		return Value(static_cast<long long>(reinterpret_cast<uint8_t*>(data)[index]));
+	}
+}
+
+void TypedArrayObject::Set(int index, Value value)
+{
+	if (!value.IsNumeric())
+		value = Value(0LL);
+	switch (type)
+	{
+	case OT_FLOAT64_ARRAY:
+		reinterpret_cast<double*>(data)[index] = value.ToNumber();
+		break;
+	case OT_INT32_ARRAY:
+		reinterpret_cast<int32_t*>(data)[index] = static_cast<int32_t>(value.ToInteger());
+		break;
+	default:
+		reinterpret_cast<uint8_t*>(data)[index] = static_cast<uint8_t>(value.ToInteger());
+		break;
+	}
+}
+
+void TypedArrayObject::MarkObjects(VM* vm)
+{
+	if (owner != this)
+		vm->MarkObject(owner);
+}
+
+int TypedArrayObject::Size()
+{
+	return sizeof(TypedArrayObject) + (owner == this ? length * ElementSize() : 0);
+}
+
+string TypedArrayObject::ToString()
 {
 	string result;
-	for (auto i : vector)
-		result += (char)i.as.integer;
+	AppendTo(result);
 	return result;
 }
 
+void TypedArrayObject::AppendTo(string& buffer)
+{
+	buffer += '[';
+	for (int i = 0; i < length; i++)
+	{
+		Get(i).AppendTo(buffer);
+		if (i != length - 1)
+			buffer += ", ";
+	}
+	buffer += ']';
+}
+
 FunctionObject::FunctionObject() { type = OT_FUNCTION; }
 
+FunctionObject* FunctionObject::Make(int closures_count)
+{
+	// Captured cells are stored right after the object, in the same allocation.
+	void* memory = ::operator new(sizeof(FunctionObject) + sizeof(UpvalueObject*) * closures_count);
+	auto function = new (memory) FunctionObject();
+	function->closures_count = closures_count;
+	return function;
+}
+
+void FunctionObject::operator delete(void* pointer)
+{
+	::operator delete(pointer);
+}
+
+UpvalueObject** FunctionObject::Closures()
+{
+	return reinterpret_cast<UpvalueObject**>(this + 1);
+}
+
 void FunctionObject::Operate(VM* vm, Operation operation)
 {
 	if (operation.code == OP_CALL)
-	{
-		vm->callee = this;
-		vm->frame->return_address = vm->current;
-		vm->current = begin;
-	} else
+		vm->Invoke(this, Value(), operation.value.as.integer);
+	else
 		Object::Operate(vm, operation);
 }
 
-void FunctionObject::Call(ValueTableObject* self)
+// Runs the call to its return. If it overflows, everything it took is
+// given back and nil is left in place of its arguments.
+void FunctionObject::Call(Value self, int arguments_count)
 {
-	this->self = self;
-	vm->exit_on_return = true;
-	Operate(vm, OP_CALL);
-	vm->Run();
-	vm->exit_on_return = false;
+	Frame* exit_frame = vm->exit_frame;
+	Frame* frame = vm->frame;
+	Frame* call_frame = vm->call_frame;
+	Frame* frames_pool_pointer = vm->frames_pool_pointer;
+	Value* base = vm->pointer - arguments_count;
+	int current = vm->current;
+
+	// Not null while entering, so an overflow there is this call's own.
+	vm->exit_frame = frames_pool_pointer;
+	bool entered = vm->Invoke(this, self, arguments_count);
+	if (entered) {
+		vm->exit_frame = vm->call_frame;
+		vm->Run();
+	}
+	if (!entered || vm->frames_pool_pointer != frames_pool_pointer) {
+		vm->CloseUpvalues(frames_pool_pointer);
+		vm->frames_pool_pointer = frames_pool_pointer;
+		vm->frame = frame;
+		vm->call_frame = call_frame;
+		vm->pointer = base;
+		vm->Push(Value());
+	}
+	vm->exit_frame = exit_frame;
+	vm->current = current;
 }
 
 void FunctionObject::MarkObjects(VM* vm)
 {
-	for (auto i : closures)
-		vm->MarkValue(i);
+	for (int i = 0; i < closures_count; i++)
+		vm->MarkObject(Closures()[i]);
+	if (owner != nullptr)
+		vm->MarkObject(owner);
 }
 
 int FunctionObject::Size()
 {
-	return sizeof(FunctionObject) + sizeof(Value) * closures.size();
+	return sizeof(FunctionObject) + sizeof(UpvalueObject*) * closures_count;
 }
 
 string FunctionObject::ToString()
@@ -218,6 +718,28 @@ string FunctionObject::ToString()
 	return "<function at " + to_string(begin) + ">";
 }
 
+UpvalueObject::UpvalueObject(Value* location, Frame* frame) : location(location), frame(frame) { type = OT_UPVALUE; }
+
+void UpvalueObject::Close()
+{
+	closed = *location;
+	location = &closed;
+	frame = nullptr;
+	owner = nullptr;
+}
+
+void UpvalueObject::MarkObjects(VM* vm)
+{
+	vm->MarkValue(*location);
+	if (owner != nullptr)
+		vm->MarkObject(owner);
+}
+
+int UpvalueObject::Size()
+{
+	return sizeof(UpvalueObject);
+}
+
 CFunctionObject::CFunctionObject(int(&function)(VM* vm)) : function(function) { type = OT_IFUNCTION; }
 
 void CFunctionObject::Operate(VM* vm, Operation operation)
@@ -232,12 +754,11 @@ void CFunctionObject::Operate(VM* vm, Operation operation)
 			value = vm->Pop();
 		for (int i = 0; i < operation.value.as.integer; i++)
 			vm->Pop();
-		if (ret > 0)
-			vm->Push(value);
-		vm->frame->return_address = -1;
+		vm->Push(value);
 		vm->parameters_count = old_parameters_count;
 	}
-	Object::Operate(vm, operation);
+	else
+		Object::Operate(vm, operation);
 }
 
 int CFunctionObject::Size()
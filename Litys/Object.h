@@ -1,6 +1,10 @@
 #ifndef OBJECT_H
 #define OBJECT_H
 #include <map>
+#include <set>
+#include <unordered_map>
+#include <new>
+#include <memory>
 
 #include "VM.h"
 #include "Value.h"
@@ -8,15 +12,24 @@
 enum OperationCode;
 
 enum ObjectType {
-	OT_OBJECT, OT_TABLE, OT_ARRAY, OT_STRING, OT_FUNCTION, OT_IFUNCTION
+	OT_OBJECT, OT_TABLE, OT_ARRAY, OT_STRING, OT_FUNCTION, OT_IFUNCTION, OT_UPVALUE,
+	OT_FLOAT64_ARRAY, OT_INT32_ARRAY, OT_UINT8_ARRAY,
+	OT_MAPPED_FILE, OT_FILE_WRITER, OT_SLICE_ITERATOR,
+	OT_CHANNEL, OT_COROUTINE
 };
 
+inline bool IsTypedArray(ObjectType type)
+{
+	return type >= OT_FLOAT64_ARRAY && type <= OT_UINT8_ARRAY;
+}
+
 class Object {
 public:
 	VM* vm;
 	ObjectType type;
 	struct {
 		bool marked = false;
+		bool shared = false; // owned outside any heap and read by several isolates, never marked
 		Object* previous = nullptr;
 		Object* previous_mark = nullptr;
 	} gc_info;
@@ -26,50 +39,153 @@ public:
 	virtual void MarkObjects(VM* vm);
 	virtual int Size();
 	virtual string ToString();
+	virtual void AppendTo(string& buffer);
+};
+
+
+// Keys are normalized first, so equal numbers hash the same way whether
+// they were written as integers or doubles.
+struct ValueHash {
+	size_t operator()(const Value& value) const;
+};
+
+struct ValueEqual {
+	bool operator()(const Value& a, const Value& b) const;
 };
 
+// Operator overloading hooks, looked up by name on a table's meta chain.
+enum Metamethod {
+	MM_ADD, MM_SUBTRACT, MM_MULTIPLY, MM_DIVIDE, MM_MOD, MM_DIV, MM_NEGATE,
+	MM_EQUAL, MM_NOT_EQUAL, MM_GREATER, MM_GREATER_EQUAL, MM_LESS, MM_LESS_EQUAL,
+	MM_RADD, MM_RSUBTRACT, MM_RMULTIPLY, MM_RDIVIDE, MM_RMOD, MM_RDIV,
+	MM_INDEX, MM_CALL, MM_LEN, MM_TO_STRING,
+	MM_COUNT
+};
+
+int MetamethodOf(OperationCode code);
+int ReflectedMetamethodOf(OperationCode code);
 
 class ValueTableObject : public Object {
 public:
 	ValueTableObject* meta = nullptr;
-	map<const char*, Value, cstrcmp> table;
+	unsigned metamethods = 0; // bit per metamethod defined in this table itself
+	map<const char*, Value, cstrcmp> table; // string keys, by content
+	vector<Value> array; // integer keys 0..n-1
+	unordered_map<Value, Value, ValueHash, ValueEqual> hash; // any other key
+	set<string> names; // owns string keys made at run time
+	unsigned version = 0; // bumped on every store and change of meta, validates invoke caches
 	ValueTableObject();
 	virtual void Operate(VM* vm, Operation operation);
 	virtual void MarkObjects(VM* vm);
 	virtual int Size();
 	Value GetValue(const char* name);
+	void SetValue(const char* name, Value value);
+	Value Get(Value key);
+	void Set(Value key, Value value);
+	bool HasMetamethod(Metamethod method);
+	Value GetMetamethod(Metamethod method);
+	bool CallMetamethod(VM* vm, Metamethod method, int arguments_count);
 	string ToString();
 };
 
 class ValueVectorObject : public Object {
 public:
 	vector<Value> vector;
+	int numbers = 0; // elements holding a double, kept up to date by Push and Set
+	int integers = 0; // elements holding an integer
 	ValueVectorObject();
+	void Push(Value value);
+	void Set(int index, Value value);
+	void Count(Value value, int delta);
+	bool Numeric();
 	virtual void Operate(VM* vm, Operation operation);
 	virtual void MarkObjects(VM* vm);
 	virtual int Size();
 	string ToString();
+	virtual void AppendTo(string& buffer);
 };
 
-class StringObject : public ValueVectorObject {
+// Strings built from one another share a growable buffer. a + b appends
+// to the buffer of a when a still ends where the buffer does and returns
+// a new string over the longer prefix, so a is left as it was and
+// building a string in a loop stays linear. A view points into memory
+// owned by another object, such as a mapped file, and gets a buffer of
+// its own only when it is changed.
+class StringObject : public Object {
 public:
+	shared_ptr<string> buffer; // null for a view
+	const char* view = nullptr;
+	Object* source = nullptr; // owner of the characters of a view
+	size_t length;
+	bool constant = false; // interned literal, never changed in place
 	StringObject(const char* cstr);
+	StringObject(shared_ptr<string> buffer, size_t length);
+	StringObject(Object* source, const char* view, size_t length);
 	virtual void Operate(VM* vm, Operation operation);
-	void Append(string string);
+	virtual void MarkObjects(VM* vm);
+	virtual int Size();
+	const char* Data();
+	size_t Length();
+	StringObject* Concat(VM* vm, Value value);
+	void Append(const string& string);
+	void Set(int index, char c);
 	string ToString();
+	virtual void AppendTo(string& buffer);
+private:
+	void Own();
+};
+
+// Packed numeric array. Elements are stored unboxed, so there is nothing
+// to mark; a slice views the buffer of its owner instead of copying it.
+class TypedArrayObject : public Object {
+public:
+	TypedArrayObject* owner;
+	char* data;
+	int length;
+	int slices = 0; // slices ever made of it, elements with none can be moved out
+	TypedArrayObject(ObjectType type, int length);
+	TypedArrayObject(ObjectType type, char* data, int length);
+	TypedArrayObject(TypedArrayObject* source, int begin, int end);
+	~TypedArrayObject();
+	int ElementSize();
+	Value Get(int index);
+	void Set(int index, Value value);
+	virtual void MarkObjects(VM* vm);
+	virtual int Size();
+	string ToString();
+	virtual void AppendTo(string& buffer);
+};
+
+class UpvalueObject : public Object {
+public:
+	Value* location; // a frame local while open, then its own closed value
+	Value closed;
+	Frame* frame;
+	Object* owner = nullptr; // coroutine whose stack an open location is on
+	UpvalueObject* next = nullptr;
+	UpvalueObject(Value* location, Frame* frame);
+	void Close();
+	virtual void MarkObjects(VM* vm);
+	virtual int Size();
 };
 
 class FunctionObject : public Object {
 public:
 	int begin;
-	ValueTableObject* self = nullptr;
-	vector<Value> closures;
-	FunctionObject();
-	void Call(ValueTableObject* self);
+	int locals_count = 0;
+	int closures_count = 0;
+	Frame* frame = nullptr; // frame the function was made in, reached by its outer locals
+	Object* owner = nullptr; // coroutine that frame belongs to, kept alive with it
+	static FunctionObject* Make(int closures_count);
+	static void operator delete(void* pointer);
+	UpvalueObject** Closures();
+	void Call(Value self, int arguments_count);
 	virtual void Operate(VM* vm, Operation operation);
 	virtual void MarkObjects(VM* vm);
 	virtual int Size();
 	string ToString();
+private:
+	FunctionObject();
 };
 
 class CFunctionObject : public Object {
@@ -0,0 +1,94 @@
+#include <cstdio>
+#include <cstring>
+#include <iostream>
+
+#ifdef _WIN32
+#include <io.h>
+#else
+#include <unistd.h>
+#endif
+
+#include "Output.h"
+
+static bool Terminal(int fd)
+{
+#ifdef _WIN32
+	return _isatty(fd) != 0;
+#else
+	return isatty(fd) != 0;
+#endif
+}
+
+static void WriteAll(int fd, const char* data, size_t size)
+{
+	while (size > 0) {
+#ifdef _WIN32
+		int written = _write(fd, data, static_cast<unsigned int>(size));
+#else
+		auto written = write(fd, data, size);
+#endif
+		if (written <= 0)
+			return;
+		data += written;
+		size -= written;
+	}
+}
+
+Output::Output(int fd) : fd(fd), tie(&sync)
+{
+	policy = Terminal(fd) ? FLUSH_LINE : FLUSH_BLOCK;
+	sync.output = this;
+}
+
+Output::~Output()
+{
+	Flush();
+	if (tied)
+		cout.tie(nullptr);
+}
+
+void Output::Write(const char* data, size_t size)
+{
+	size_t from = buffer.size();
+	buffer.append(data, size);
+	Written(from);
+}
+
+// Called after text was appended to the buffer directly.
+void Output::Written(size_t from)
+{
+	if (from > buffer.size()) // flushed in between, by a nested print
+		from = 0;
+	if (policy == FLUSH_LINE && memchr(buffer.data() + from, '\n', buffer.size() - from) != nullptr)
+		Flush();
+	else if (policy == FLUSH_BLOCK && buffer.size() >= OUTPUT_BLOCK)
+		Flush();
+}
+
+void Output::Flush()
+{
+	if (buffer.empty())
+		return;
+	// cout writes through stdio, whatever it still holds goes first.
+	fflush(stdout);
+	WriteAll(fd, buffer.data(), buffer.size());
+	buffer.clear();
+}
+
+// Makes anything written to cout flush this buffer first.
+void Output::Tie()
+{
+	cout.tie(&tie);
+	tied = true;
+}
+
+int Output::Descriptor()
+{
+	return fd;
+}
+
+int Output::Sync::sync()
+{
+	output->Flush();
+	return 0;
+}
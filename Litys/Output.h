@@ -0,0 +1,40 @@
+#ifndef OUTPUT_H
+#define OUTPUT_H
+
+#include <string>
+#include <ostream>
+
+using namespace std;
+
+enum FlushPolicy { FLUSH_LINE, FLUSH_BLOCK, FLUSH_EXPLICIT };
+
+// Bytes kept before a FLUSH_BLOCK buffer is written out.
+const size_t OUTPUT_BLOCK = 64 * 1024;
+
+// Buffered writer straight to a file descriptor, bypassing iostream. The
+// buffer is written out at the end of a line, when a block is full or
+// only on Flush, depending on the policy. Once tied, anything written to
+// cout flushes it first, so error messages keep their place.
+class Output {
+public:
+	string buffer;
+	FlushPolicy policy;
+	Output(int fd);
+	~Output();
+	void Write(const char* data, size_t size);
+	void Written(size_t from);
+	void Flush();
+	void Tie();
+	int Descriptor();
+private:
+	struct Sync : public streambuf {
+		Output* output;
+		virtual int sync();
+	};
+	int fd;
+	Sync sync;
+	ostream tie;
+	bool tied = false; // only the tied output touches cout, others run on other threads
+};
+
+#endif
@@ -24,7 +24,7 @@ void IdentifierNode::Compile(Assembly& assembly)
 		assembly.Put(Operation(OP_LOAD_NAME, value));
 }
 
-NumberNode::NumberNode(double value) : value(value) { type = T_NUMBER; }
+NumberNode::NumberNode(Value value) : value(value) { type = T_NUMBER; }
 
 void NumberNode::Compile(Assembly& assembly)
 {
@@ -47,12 +47,18 @@ StringNode::StringNode(const char* value) : value(value) { type = T_STRING; }
 
 void StringNode::Compile(Assembly& assembly)
 {
-	assembly.Put(Operation(OP_PUSH, value));
-	assembly.Put(Operation(OP_NEW_OBJ, 2));
+	assembly.Put(Operation(OP_PUSH_STRING, value));
 }
 
 BinOpNode::BinOpNode(TokenType operation, Node* left, Node* right) : operation(operation), left(left), right(right) {}
 BinOpNode::~BinOpNode() { delete left; delete right; }
+void BinOpNode::Walk(Inliner& inliner) { left->Walk(inliner); right->Walk(inliner); }
+
+int BinOpNode::Cost()
+{
+	int l = left->Cost(), r = right->Cost();
+	return l < 0 || r < 0 ? -1 : l + r + 1;
+}
 
 void BinOpNode::Compile(Assembly& assembly)
 {
@@ -107,22 +113,29 @@ void BinOpNode::Compile(Assembly& assembly)
 
 UnOpNode::UnOpNode(TokenType operation, Node* node) : operation(operation), node(node) {}
 UnOpNode::~UnOpNode() { delete node; }
+void UnOpNode::Walk(Inliner& inliner) { node->Walk(inliner); }
+int UnOpNode::Cost() { int n = node->Cost(); return n < 0 ? -1 : n + 1; }
 
 void UnOpNode::Compile(Assembly& assembly)
 {
 	node->Compile(assembly);
-	assembly.Put(Operation(operation == T_BANG ? OP_NOT : OP_NEGATE));
+	assembly.Put(Operation(operation == T_BANG ? OP_NOT : operation == T_HASH ? OP_LEN : OP_NEGATE));
 }
 
-AssignNode::AssignNode(const char* name, Node* node) : name(name), node(node) {}
+AssignNode::AssignNode(const char* name, Node* node) : name(name), node(node) { type = T_EQUAL; }
 
 AssignNode::~AssignNode() { delete node; }
+void AssignNode::Walk(Inliner& inliner) { inliner.Assign(name); node->Walk(inliner); }
 
 void AssignNode::Compile(Assembly& assembly)
 {
 	node->Compile(assembly);
 
-	if (assembly.compiler->previous->global) {
+	Value j = assembly.compiler->GetClosure(name);
+	if (j.type != V_NIL) {
+		assembly.Put(Operation(OP_STORE_CLOSURE, j));
+	}
+	else if (assembly.compiler->previous->global) {
 		assembly.Put(Operation(OP_STORE_NAME, name));
 	}
 	else {
@@ -139,6 +152,7 @@ void AssignNode::Compile(Assembly& assembly)
 
 BlockNode::BlockNode() : return_table(false) { type = T_BEGIN; }
 BlockNode::~BlockNode() { for (auto i : nodes) delete i; }
+void BlockNode::Walk(Inliner& inliner) { for (auto i : nodes) if (i != nullptr) i->Walk(inliner); }
 
 void BlockNode::Compile(Assembly& assembly)
 {
@@ -160,6 +174,14 @@ IfNode::IfNode(Node* condition, Node* then_branch, Node* else_branch) : conditio
 
 IfNode::~IfNode() { delete condition; delete then_branch; if (else_branch != nullptr) delete else_branch; }
 
+void IfNode::Walk(Inliner& inliner)
+{
+	condition->Walk(inliner);
+	then_branch->Walk(inliner);
+	if (else_branch != nullptr)
+		else_branch->Walk(inliner);
+}
+
 void IfNode::Compile(Assembly& assembly)
 {
 	condition->Compile(assembly);
@@ -176,6 +198,7 @@ void IfNode::Compile(Assembly& assembly)
 
 WhileNode::WhileNode(Node* condition, Node* branch) : condition(condition), branch(branch) {}
 WhileNode::~WhileNode() { delete condition; delete branch; }
+void WhileNode::Walk(Inliner& inliner) { condition->Walk(inliner); branch->Walk(inliner); }
 
 void WhileNode::Compile(Assembly& assembly)
 {
@@ -191,6 +214,14 @@ void WhileNode::Compile(Assembly& assembly)
 ForNode::ForNode(Node* initializer, Node* condition, Node* increment, Node* branch) : initializer(initializer), condition(condition), increment(increment), branch(branch) {}
 ForNode::~ForNode() { delete initializer; delete condition; delete increment; delete branch; }
 
+void ForNode::Walk(Inliner& inliner)
+{
+	initializer->Walk(inliner);
+	condition->Walk(inliner);
+	increment->Walk(inliner);
+	branch->Walk(inliner);
+}
+
 void ForNode::Compile(Assembly& assembly)
 {
 	initializer->Compile(assembly);
@@ -205,41 +236,122 @@ void ForNode::Compile(Assembly& assembly)
 }
 
 
-CallNode::CallNode(Node* callee) : callee(callee) {}
+CallNode::CallNode(Node* callee) : callee(callee) { type = T_LEFT_PAREN; }
 CallNode::~CallNode() { delete callee;  for (auto i : arguments) delete i; }
 
+void CallNode::Walk(Inliner& inliner)
+{
+	callee->Walk(inliner);
+	for (auto i : arguments)
+		i->Walk(inliner);
+	inliner.Call(this);
+}
+
 void CallNode::Compile(Assembly& assembly)
 {
+	if (inlined != nullptr) {
+		auto name = static_cast<IdentifierNode*>(callee)->value;
+		if (assembly.compiler->GetLocal(name).type == V_NIL && assembly.compiler->GetClosure(name).type == V_NIL) {
+			Inline(assembly);
+			return;
+		}
+	}
+
 	for (auto i : arguments)
 		i->Compile(assembly);
+
+	if (callee->type == T_DOT)
+	{
+		auto get = static_cast<GetNode*>(callee);
+		get->node->Compile(assembly);
+		assembly.Put(Operation(OP_INVOKE, get->name.c_str(), static_cast<int>(arguments.size())));
+		return;
+	}
+
 	callee->Compile(assembly);
-	assembly.Put(Operation(OP_CALL, static_cast<int>(arguments.size())));
+	assembly.Put(Operation(tail ? OP_TAIL_CALL : OP_CALL, static_cast<int>(arguments.size())));
+}
+
+void CallNode::Inline(Assembly& assembly)
+{
+	for (auto i : arguments)
+		i->Compile(assembly);
+
+	// Arguments are stored last first, after all of them are evaluated, so
+	// nested inlined calls can share the hidden locals of the calling scope.
+	auto compiler = assembly.compiler;
+	auto scope = new Compiler();
+	scope->function = true;
+	for (int i = static_cast<int>(arguments.size()) - 1; i >= 0; i--)
+	{
+		const char* hidden = inlined->hidden[i].c_str();
+		int slot = 0;
+		while (slot < compiler->locals.size() && strcmp(compiler->locals[slot], hidden) != 0)
+			slot++;
+		if (slot == compiler->locals.size())
+			compiler->locals.push_back(hidden);
+		assembly.Put(Operation(OP_STORE_FAST, Value(slot, 0)));
+
+		if (scope->locals.size() <= slot)
+			scope->locals.resize(slot + 1, "");
+		scope->locals[slot] = inlined->parameters[i].c_str();
+	}
+
+	// The body sees only its parameters, every other name is a global.
+	assembly.compiler = scope;
+	inlined->InlineBody()->Compile(assembly);
+	delete scope;
+	assembly.compiler = compiler;
 }
 
-FnDefNode::FnDefNode(bool closure, string name, Node* branch, vector<string> parameters, vector<IdentifierNode*> closures) : closure(closure), name(name), branch(branch), parameters(parameters), closures(closures) {}
+FnDefNode::FnDefNode(bool closure, string name, Node* branch, vector<string> parameters, vector<IdentifierNode*> closures) : closure(closure), name(name), branch(branch), parameters(parameters), closures(closures) { type = T_FN; }
 FnDefNode::~FnDefNode() { delete branch; for (auto i : closures) delete i; }
 
+void FnDefNode::Walk(Inliner& inliner)
+{
+	if (!closure)
+		inliner.Assign(name.c_str());
+	branch->Walk(inliner);
+}
+
+Node* FnDefNode::InlineBody()
+{
+	if (branch->type != T_BEGIN)
+		return nullptr;
+	auto& nodes = static_cast<BlockNode*>(branch)->nodes;
+	if (nodes.size() != 1 || nodes[0] == nullptr || nodes[0]->type != T_RETURN)
+		return nullptr;
+	return static_cast<ReturnNode*>(nodes[0])->node;
+}
+
 void FnDefNode::Compile(Assembly& assembly)
 {
 	auto previous_compiler = assembly.compiler;
 
+	// Captured locals are shared through upvalue cells; anything else is
+	// captured by value into a closed cell.
+	for (auto i : closures) {
+		Value j = previous_compiler->GetClosure(i->value);
+		Value l = previous_compiler->GetLocal(i->value);
+		if (j.type != V_NIL)
+			assembly.Put(Operation(OP_CAPTURE_CLOSURE, j));
+		else if (l.type != V_NIL)
+			assembly.Put(Operation(OP_CAPTURE_FAST, l));
+		else {
+			i->Compile(assembly);
+			assembly.Put(Operation(OP_CAPTURE_VALUE));
+		}
+	}
+
 	assembly.compiler = new Compiler();
 	assembly.compiler->previous = previous_compiler;
+	assembly.compiler->function = true;
+	for (auto i : closures)
+		assembly.compiler->closures.push_back(i->value);
 
 	int make_func_index = assembly.Size();
 	assembly.Put(Operation(OP_MAKE_FUNCTION));
 
-	auto f_compiler = assembly.compiler;
-	assembly.compiler = previous_compiler;
-
-	for (auto i : closures) {
-		i->Compile(assembly);
-		assembly.Put(Operation(OP_STORE_CLOSURE));
-		assembly.compiler->closures.push_back(i->value);
-	}
-
-	assembly.compiler = f_compiler;
-
 	if (!closure)
 	{
 		Value i;
@@ -251,39 +363,80 @@ void FnDefNode::Compile(Assembly& assembly)
 
 	int jump_index = assembly.Size();
 	assembly.Put(Operation(OP_JUMP, 0));
-	assembly.Set(make_func_index, assembly.Size());
-	assembly.Put(Operation(OP_ADD_FRAME));
+	assembly.SetArgument(make_func_index, assembly.Size());
 
-	int j = 0;
-	for (int i = parameters.size() - 1; i >= 0; i--)
-	{
-		assembly.compiler->locals.push_back(parameters[i].c_str());
-		assembly.Put(Operation(OP_STORE_FAST, Value(j, 0)));
-		j++;
-	}
+	// Arguments are left on the stack by the caller and become the first
+	// locals of the function frame, so a block body shares that frame.
+	for (auto& i : parameters)
+		assembly.compiler->locals.push_back(i.c_str());
 
-	branch->Compile(assembly);
-	assembly.Put(Operation(OP_POP_FRAME, 0));
+	if (branch->type == T_BEGIN)
+		for (auto i : static_cast<BlockNode*>(branch)->nodes)
+			i->Compile(assembly);
+	else
+		branch->Compile(assembly);
 	assembly.Put(Operation(OP_RETURN, false));
 
 	assembly.Set(jump_index, assembly.Size());
+	assembly.Set(make_func_index, Value(static_cast<short>(assembly.compiler->locals.size()), static_cast<short>(closures.size())));
 	
 	delete assembly.compiler;
 	assembly.compiler = previous_compiler;
 }
 
-ReturnNode::ReturnNode(Node* node) : node(node) {}
+ReturnNode::ReturnNode(Node* node) : node(node) { type = T_RETURN; }
 ReturnNode::~ReturnNode() { delete node; }
+void ReturnNode::Walk(Inliner& inliner) { if (node != nullptr) node->Walk(inliner); }
 
 void ReturnNode::Compile(Assembly& assembly)
 {
+	if (node != nullptr && node->type == T_LEFT_PAREN)
+		static_cast<CallNode*>(node)->tail = true;
 	if (node != nullptr) 
 		node->Compile(assembly);
 	assembly.Put(Operation(OP_RETURN, node != nullptr));
 }
 
+DiscardNode::DiscardNode(Node* node) : node(node) {}
+DiscardNode::~DiscardNode() { delete node; }
+void DiscardNode::Walk(Inliner& inliner) { node->Walk(inliner); }
+
+void DiscardNode::Compile(Assembly& assembly)
+{
+	node->Compile(assembly);
+	assembly.Put(Operation(OP_POP, 1));
+}
+
+YieldNode::YieldNode(Node* node, bool push) : node(node), push(push) { type = T_YIELD; }
+YieldNode::~YieldNode() { delete node; }
+void YieldNode::Walk(Inliner& inliner) { if (node != nullptr) node->Walk(inliner); }
+
+void YieldNode::Compile(Assembly& assembly)
+{
+	if (node != nullptr)
+		node->Compile(assembly);
+	else
+		assembly.Put(Operation(OP_PUSH, Value()));
+	assembly.Put(Operation(OP_YIELD, Value(push)));
+}
+
+ResumeNode::ResumeNode(vector<Node*> arguments) : arguments(arguments) { type = T_RESUME; }
+ResumeNode::~ResumeNode() { for (auto i : arguments) delete i; }
+void ResumeNode::Walk(Inliner& inliner) { for (auto i : arguments) i->Walk(inliner); }
+
+void ResumeNode::Compile(Assembly& assembly)
+{
+	// Laid out as a call: the values first, the coroutine on top of them.
+	for (size_t i = 1; i < arguments.size(); i++)
+		arguments[i]->Compile(assembly);
+	arguments[0]->Compile(assembly);
+	assembly.Put(Operation(OP_RESUME, static_cast<int>(arguments.size()) - 1));
+}
+
 GetNode::GetNode(Node* node, string name) : node(node), name(name) { type = T_DOT; }
 GetNode::~GetNode() { delete node; }
+void GetNode::Walk(Inliner& inliner) { node->Walk(inliner); }
+int GetNode::Cost() { int n = node->Cost(); return n < 0 ? -1 : n + 1; }
 
 void GetNode::Compile(Assembly& assembly)
 {
@@ -294,6 +447,13 @@ void GetNode::Compile(Assembly& assembly)
 
 IndexNode::IndexNode(Node* node, Node* index) : node(node), index(index) { type = T_LEFT_SCR; }
 IndexNode::~IndexNode() { delete node; delete index; }
+void IndexNode::Walk(Inliner& inliner) { node->Walk(inliner); index->Walk(inliner); }
+
+int IndexNode::Cost()
+{
+	int n = node->Cost(), i = index->Cost();
+	return n < 0 || i < 0 ? -1 : n + i + 1;
+}
 
 void IndexNode::Compile(Assembly& assembly)
 {
@@ -306,6 +466,15 @@ SetNode::SetNode(GetNode* get, Node* value) : get(get), value(value) {}
 SetNode::SetNode(IndexNode* index, Node* value) : index(index), value(value) {}
 SetNode::~SetNode() { delete get; delete index; delete value; }
 
+void SetNode::Walk(Inliner& inliner)
+{
+	if (get != nullptr)
+		get->Walk(inliner);
+	else if (index != nullptr)
+		index->Walk(inliner);
+	value->Walk(inliner);
+}
+
 void SetNode::Compile(Assembly& assembly)
 {
 	if (get != nullptr) {
@@ -326,6 +495,14 @@ void SetNode::Compile(Assembly& assembly)
 
 TableNode::~TableNode() { for (auto i : assigns) delete i; }
 
+void TableNode::Walk(Inliner& inliner)
+{
+	if (meta != nullptr)
+		meta->Walk(inliner);
+	for (auto i : assigns)
+		i->Walk(inliner);
+}
+
 void TableNode::Compile(Assembly& assembly)
 {
 	assembly.Put(Operation(OP_NEW_OBJ, 1));
@@ -343,6 +520,7 @@ void TableNode::Compile(Assembly& assembly)
 }
 
 ArrayNode::~ArrayNode() { for (auto i : values) delete i; }
+void ArrayNode::Walk(Inliner& inliner) { for (auto i : values) i->Walk(inliner); }
 
 void ArrayNode::Compile(Assembly& assembly)
 {
@@ -359,11 +537,13 @@ void GetSelfNode::Compile(Assembly& assembly)
 	assembly.Put(OP_GET_SELF);
 }
 
-Parser::Parser(vector<Token> tokens) : tokens(tokens) {}
+Parser::Parser(vector<Token> tokens) : current(0), tokens(tokens) {}
 
 Node *Parser::Parse()
 {
-	return Block();
+	auto root = static_cast<BlockNode*>(Block());
+	Inliner().Run(root);
+	return root;
 }
 
 bool Parser::Check(TokenType type)
@@ -422,6 +602,11 @@ Node* Parser::Statement()
 		return ReturnStatement();
 	}
 
+	if (Check(T_YIELD)) {
+		Advance();
+		return YieldStatement();
+	}
+
 	if (Check(T_FN)) {
 		Advance();
 		return FnStatement(false);
@@ -449,20 +634,30 @@ Node* Parser::Statement()
 
 	auto expr = Expression();
 	Consume(T_SEMICOLON, "Expected semicolon after expression statement.");
-	return expr;
+	// Assignments and blocks leave nothing, any other expression one value.
+	if (expr->type == T_EQUAL || expr->type == T_BEGIN)
+		return expr;
+	return new DiscardNode(expr);
 }
 
 Node* Parser::ReturnStatement()
 {
 	ReturnNode* node = new ReturnNode(nullptr);
-	if (Check(T_SEMICOLON))
-		Advance();
-	else
+	if (!Check(T_SEMICOLON))
 		node->node = Or();
 	Consume(T_SEMICOLON, "Expected semicolon after return statement.");
 	return node;
 }
 
+Node* Parser::YieldStatement()
+{
+	YieldNode* node = new YieldNode(nullptr, false);
+	if (!Check(T_SEMICOLON))
+		node->node = Or();
+	Consume(T_SEMICOLON, "Expected semicolon after yield statement.");
+	return node;
+}
+
 Node* Parser::FnStatement(bool closure)
 {
 	string name;
@@ -663,13 +858,19 @@ Node *Parser::Factor()
 
 Node *Parser::Unary()
 {
-	if (Check(T_BANG) || Check(T_MINUS)) {
+	if (Check(T_BANG) || Check(T_MINUS) || Check(T_HASH)) {
 		Advance();
 		Token op = Previous();
 		Node *right = Unary();
 		return new UnOpNode(op.type, right);
 	}
 
+	// Takes all of the expression after it, as return does.
+	if (Check(T_YIELD)) {
+		Advance();
+		return new YieldNode(Check(T_SEMICOLON) || Check(T_RIGHT_PAREN) ? nullptr : Or(), true);
+	}
+
 	return Call();
 }
 
@@ -743,7 +944,7 @@ Node *Parser::Primary()
 
 	if (Check(T_NUMBER)) {
 		Advance();
-		return new NumberNode(Previous().value.as.number);
+		return new NumberNode(Previous().value);
 	}
 
 	if (Check(T_STRING)) {
@@ -751,6 +952,19 @@ Node *Parser::Primary()
 		return new StringNode(Previous().value.as.c_str);
 	}
 
+	if (Check(T_RESUME)) {
+		Advance();
+		Consume(T_LEFT_PAREN, "Expected left parenthesis after resume.");
+		vector<Node*> arguments;
+		arguments.push_back(Or());
+		while (Check(T_COMMA)) {
+			Advance();
+			arguments.push_back(Or());
+		}
+		Consume(T_RIGHT_PAREN, "Expected right parenthesis after resume arguments.");
+		return new ResumeNode(arguments);
+	}
+
 	if (Check(T_SELF)) {
 		Advance();
 		return new GetSelfNode();
@@ -829,4 +1043,44 @@ Node* Parser::Array()
 	return node;
 }
 
+void Inliner::Run(BlockNode* root)
+{
+	root->Walk(*this);
 
+	for (auto i : root->nodes)
+	{
+		if (i == nullptr || i->type != T_EQUAL)
+			continue;
+		auto assign = static_cast<AssignNode*>(i);
+		if (assign->node->type != T_FN || assigns[assign->name] != 1)
+			continue;
+		auto function = static_cast<FnDefNode*>(assign->node);
+		auto body = function->InlineBody();
+		if (!function->closures.empty() || body == nullptr)
+			continue;
+		int cost = body->Cost();
+		if (cost < 0 || cost > BUDGET)
+			continue;
+
+		for (auto& j : function->parameters)
+			function->hidden.push_back("@" + j);
+		functions[assign->name] = function;
+	}
+
+	if (!functions.empty())
+		root->Walk(*this);
+}
+
+void Inliner::Assign(const char* name)
+{
+	assigns[name]++;
+}
+
+void Inliner::Call(CallNode* call)
+{
+	if (functions.empty() || call->callee->type != T_IDENTIFIER)
+		return;
+	auto i = functions.find(static_cast<IdentifierNode*>(call->callee)->value);
+	if (i != functions.end() && i->second->parameters.size() == call->arguments.size())
+		call->inlined = i->second;
+}
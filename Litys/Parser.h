@@ -2,6 +2,7 @@
 #define PARSER_H
 
 #include <vector>
+#include <map>
 #include <iostream>
 
 #include "Token.h"
@@ -11,10 +12,14 @@ using namespace std;
 
 string Indent(int depth);
 
+class Inliner;
+
 class Node {
 public:
-	TokenType type;
+	TokenType type = T_END_OF_FILE;
 	virtual void Compile(Assembly& assembly) {}
+	virtual void Walk(Inliner&) {}
+	virtual int Cost() { return -1; } // operations emitted when inlined, -1 if it can't be
 	virtual string ToString(int depth = 0) { return "None"; }
 	virtual ~Node() {}
 };
@@ -24,15 +29,17 @@ public:
 	const char* value;
 	IdentifierNode(const char* value);
 	void Compile(Assembly& assembly);
+	int Cost() { return 1; }
 	std::string ToString(int depth = 0) { return Indent(depth) + std::string(value); }; // FREE STRING MAYBE
 };
 
 class NumberNode : public Node {
 public:
-	double value;
-	NumberNode(double value);
+	Value value;
+	NumberNode(Value value);
 	void Compile(Assembly& assembly);
-	string ToString(int depth = 0) { return Indent(depth) + (trunc(value) == value ? to_string((int)value) : to_string(value)); };
+	int Cost() { return 1; }
+	string ToString(int depth = 0) { return Indent(depth) + value.ToString(); };
 };
 
 class BoolNode : public Node {
@@ -40,12 +47,14 @@ public:
 	bool value;
 	BoolNode(bool value);
 	void Compile(Assembly& assembly);
+	int Cost() { return 1; }
 	string ToString(int depth = 0) { return Indent(depth) + (value ? "true" : "false"); };
 };
 
 class NilNode : public Node {
 public:
 	void Compile(Assembly& assembly);
+	int Cost() { return 1; }
 	string ToString(int depth = 0) { return Indent(depth) + "NIL"; };
 };
 
@@ -55,6 +64,7 @@ public:
 	const char* value;
 	StringNode(const char* value);
 	void Compile(Assembly& assembly);
+	int Cost() { return 2; }
 	std::string ToString(int depth = 0) { return Indent(depth) + std::string(value); }; // FREE STRING MAYBE
 };
 
@@ -65,6 +75,8 @@ public:
 	BinOpNode(TokenType operation, Node* left, Node* right);
 	~BinOpNode();
 	void Compile(Assembly& assembly);
+	void Walk(Inliner& inliner);
+	int Cost();
 	std::string ToString(int depth = 0) { return Indent(depth) + TokenTypeName(operation) + "\n" + left->ToString(depth + 1) + "\n" + right->ToString(depth + 1); };
 }; 
 
@@ -75,6 +87,8 @@ public:
 	UnOpNode(TokenType operation, Node* node);
 	~UnOpNode();
 	void Compile(Assembly& assembly);
+	void Walk(Inliner& inliner);
+	int Cost();
 	std::string ToString(int depth = 0) { return Indent(depth) + TokenTypeName(operation) + "\n" + node->ToString(depth + 1); };
 };
 
@@ -86,6 +100,7 @@ public:
 	AssignNode(const char* name, Node* node);
 	~AssignNode();
 	void Compile(Assembly& assembly);
+	void Walk(Inliner& inliner);
 	std::string ToString(int depth = 0) { return Indent(depth) + "ASSIGN\n" + Indent(depth + 1) + name + "\n" + node->ToString(depth + 1); };
 };
 
@@ -96,6 +111,7 @@ public:
 	BlockNode();
 	~BlockNode();
 	void Compile(Assembly& assembly);
+	void Walk(Inliner& inliner);
 	std::string ToString(int depth = 0)
 	{
 		string result = Indent(depth) + "BLOCK " + to_string(return_table);
@@ -113,6 +129,7 @@ public:
 	IfNode(Node* condition, Node* then_branch, Node* else_branch);
 	~IfNode();
 	void Compile(Assembly& assembly);
+	void Walk(Inliner& inliner);
 	std::string ToString(int depth = 0)
 	{
 		string result = Indent(depth) + "IF";
@@ -131,6 +148,7 @@ public:
 	WhileNode(Node* condition, Node* branch);
 	~WhileNode();
 	void Compile(Assembly& assembly);
+	void Walk(Inliner& inliner);
 	std::string ToString(int depth = 0)
 	{
 		string result = Indent(depth) + "WHILE";
@@ -149,6 +167,7 @@ public:
 	ForNode(Node* initializer, Node* condition, Node* increment, Node* branch);
 	~ForNode();
 	void Compile(Assembly& assembly);
+	void Walk(Inliner& inliner);
 	std::string ToString(int depth = 0)
 	{
 		string result = Indent(depth) + "FOR";
@@ -160,13 +179,19 @@ public:
 	}
 };
 
+class FnDefNode;
+
 class CallNode : public Node {
 public:
 	Node* callee;
 	vector<Node*> arguments;
+	bool tail = false;
+	FnDefNode* inlined = nullptr; // small function whose body replaces this call
 	CallNode(Node* callee);
 	~CallNode();
 	void Compile(Assembly& assembly);
+	void Walk(Inliner& inliner);
+	void Inline(Assembly& assembly);
 	std::string ToString(int depth = 0)
 	{
 		string result = Indent(depth) + "CALL";
@@ -183,10 +208,13 @@ public:
 	string name;
 	vector<string> parameters;
 	vector<IdentifierNode*> closures;
+	vector<string> hidden; // caller locals holding the parameters of inlined calls
 	Node* branch;
 	FnDefNode(bool closure, string name, Node* branch, vector<string> parameters, vector<IdentifierNode*> closures);
 	~FnDefNode();
 	void Compile(Assembly& assembly);
+	void Walk(Inliner& inliner);
+	Node* InlineBody();
 	std::string ToString(int depth = 0)
 	{
 		string result = Indent(depth) + "FN DEF " + (closure ? "closure" : "");
@@ -205,6 +233,7 @@ public:
 	ReturnNode(Node* node);
 	~ReturnNode();
 	void Compile(Assembly& assembly);
+	void Walk(Inliner& inliner);
 	std::string ToString(int depth = 0)
 	{
 		if (node != nullptr)
@@ -214,6 +243,53 @@ public:
 	}
 };
 
+// An expression statement, drops the value its expression leaves.
+class DiscardNode : public Node {
+public:
+	Node* node;
+	DiscardNode(Node* node);
+	~DiscardNode();
+	void Compile(Assembly& assembly);
+	void Walk(Inliner& inliner);
+	std::string ToString(int depth = 0) { return Indent(depth) + "DISCARD\n" + node->ToString(depth + 1); };
+};
+
+// Stops the running coroutine with the value of node; push when the value
+// it is resumed with is the value of the expression.
+class YieldNode : public Node {
+public:
+	Node* node;
+	bool push;
+	YieldNode(Node* node, bool push);
+	~YieldNode();
+	void Compile(Assembly& assembly);
+	void Walk(Inliner& inliner);
+	std::string ToString(int depth = 0)
+	{
+		if (node != nullptr)
+			return Indent(depth) + "YIELD\n" + node->ToString(depth + 1);
+		else
+			return Indent(depth) + "YIELD void";
+	}
+};
+
+// resume(coroutine, arguments...)
+class ResumeNode : public Node {
+public:
+	vector<Node*> arguments;
+	ResumeNode(vector<Node*> arguments);
+	~ResumeNode();
+	void Compile(Assembly& assembly);
+	void Walk(Inliner& inliner);
+	std::string ToString(int depth = 0)
+	{
+		string result = Indent(depth) + "RESUME";
+		for (auto i : arguments)
+			result += '\n' + i->ToString(depth + 1);
+		return result;
+	}
+};
+
 class GetNode : public Node {
 public:
 	Node* node;
@@ -221,6 +297,8 @@ public:
 	GetNode(Node* node, string name);
 	~GetNode();
 	void Compile(Assembly& assembly);
+	void Walk(Inliner& inliner);
+	int Cost();
 	std::string ToString(int depth = 0) { return Indent(depth) + "GET " + name + "\n" + node->ToString(depth + 1); };
 };
 
@@ -231,18 +309,21 @@ public:
 	IndexNode(Node* node, Node* index);
 	~IndexNode();
 	void Compile(Assembly& assembly);
+	void Walk(Inliner& inliner);
+	int Cost();
 	std::string ToString(int depth = 0) { return Indent(depth) + "INDEX\n" + index->ToString(depth + 1) + "\n" + node->ToString(depth + 1); };
 };
 
 class SetNode : public Node {
 public:
-	GetNode* get;
-	IndexNode* index;
+	GetNode* get = nullptr;
+	IndexNode* index = nullptr;
 	Node* value;
 	SetNode(GetNode* get, Node* value);
 	SetNode(IndexNode* index, Node* value);
 	~SetNode();
 	void Compile(Assembly& assembly);
+	void Walk(Inliner& inliner);
 	std::string ToString(int depth = 0) { return Indent(depth) + "SET\n" + (get != nullptr ? get->ToString(depth + 1) : index->ToString(depth + 1)) + "\n" + value->ToString(depth + 1); };
 };
 
@@ -252,6 +333,7 @@ public:
 	vector<AssignNode*> assigns;
 	~TableNode();
 	void Compile(Assembly& assembly);
+	void Walk(Inliner& inliner);
 	std::string ToString(int depth = 0)
 	{
 		string result = Indent(depth) + "TABLE ";
@@ -268,6 +350,7 @@ public:
 	vector<Node*> values;
 	~ArrayNode();
 	void Compile(Assembly& assembly);
+	void Walk(Inliner& inliner);
 	std::string ToString(int depth = 0)
 	{
 		string result = Indent(depth) + "ARRAY";
@@ -283,6 +366,18 @@ public:
 	std::string ToString(int depth = 0) { return Indent(depth) + "SELF"; };
 };
 
+// Finds small global functions that are assigned once and substitutes
+// their bodies at call sites instead of calling them.
+class Inliner {
+public:
+	static const int BUDGET = 12;
+	map<string, int> assigns;
+	map<string, FnDefNode*> functions;
+	void Run(BlockNode* root);
+	void Assign(const char* name);
+	void Call(CallNode* call);
+};
+
 class Parser {
 private:
 	unsigned int current;
@@ -300,6 +395,7 @@ private:
 	Node* Block();
 	Node* Statement();
 	Node* ReturnStatement();
+	Node* YieldStatement();
 	Node* FnStatement(bool closure);
 	Node* IfStatement();
 	Node* WhileStatement();
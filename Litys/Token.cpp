@@ -11,7 +11,7 @@ Token::Token(TokenType type, Value value) : type(type), value(value)
 
 string tokentype2string[] {
 	"LEFT_PAREN", "RIGHT_PAREN", "BEGIN", "END", "LEFT_SCR", "RIGHT_SCR", "LEFT_BRACE", "RIGHT_BRACE",
-	"COMMA", "DOT", "MINUS", "PLUS", "SEMICOLON", "SLASH", "STAR", "PERCENT", "DSLASH",
+	"COMMA", "DOT", "MINUS", "PLUS", "SEMICOLON", "SLASH", "STAR", "PERCENT", "DSLASH", "HASH",
 
 	"BANG", "BANG_EQUAL",
 	"EQUAL", "EQUAL_EQUAL",
@@ -21,7 +21,7 @@ string tokentype2string[] {
 	"IDENTIFIER", "STRING", "NUMBER", "GLOBAL",
 
 	"AND", "ELSE", "FALSE", "FN", "FOR", "IF", "NIL", "OR",
-	"RETURN", "TRUE", "WHILE", "FROM", "LOAD", "AS", "META", "SELF",
+	"RETURN", "TRUE", "WHILE", "FROM", "LOAD", "AS", "META", "SELF", "YIELD", "RESUME",
 
 	"END_OF_FILE"
 };
@@ -1,9 +1,13 @@
 #include <iostream>
 #include <string>
 #include <chrono>
+#include <climits>
 
 #include "VM.h"
 #include "Object.h"
+#include "File.h"
+#include "Isolate.h"
+#include "Coroutine.h"
 
 string operatioCode2string[]{
 	"PUSH", "POP",
@@ -23,6 +27,38 @@ string operatioCode2string[]{
 	"RETURN",
 
 	"NEW_OBJ", "SET_META",
+
+	"ADD_NUM", "SUBTRACT_NUM", "MULTIPLY_NUM", "DIVIDE_NUM",
+
+	"EQUAL_NUM", "NOT_EQUAL_NUM", "GREATER_NUM", "GREATER_EQUAL_NUM", "LESS_NUM", "LESS_EQUAL_NUM",
+
+	"ADD_STR",
+
+	"ADD_INT", "SUBTRACT_INT", "MULTIPLY_INT", "MOD_INT", "DIV_INT",
+
+	"EQUAL_INT", "NOT_EQUAL_INT", "GREATER_INT", "GREATER_EQUAL_INT", "LESS_INT", "LESS_EQUAL_INT",
+
+	"TEST_EQUAL_NUM", "TEST_NOT_EQUAL_NUM", "TEST_GREATER_NUM", "TEST_GREATER_EQUAL_NUM", "TEST_LESS_NUM", "TEST_LESS_EQUAL_NUM",
+
+	"TEST_EQUAL_INT", "TEST_NOT_EQUAL_INT", "TEST_GREATER_INT", "TEST_GREATER_EQUAL_INT", "TEST_LESS_INT", "TEST_LESS_EQUAL_INT",
+
+	"LOAD_GLOBAL", "STORE_GLOBAL",
+
+	"INVOKE", "TAIL_CALL",
+
+	"CAPTURE_FAST", "CAPTURE_CLOSURE", "CAPTURE_VALUE",
+
+	"LEN", "PUSH_STRING",
+
+	"YIELD", "RESUME",
+
+	"ADD_NUM_INT", "SUBTRACT_NUM_INT", "MULTIPLY_NUM_INT", "DIVIDE_NUM_INT",
+
+	"EQUAL_NUM_INT", "NOT_EQUAL_NUM_INT", "GREATER_NUM_INT", "GREATER_EQUAL_NUM_INT", "LESS_NUM_INT", "LESS_EQUAL_NUM_INT",
+
+	"ADD_INT_NUM", "SUBTRACT_INT_NUM", "MULTIPLY_INT_NUM", "DIVIDE_INT_NUM",
+
+	"EQUAL_INT_NUM", "NOT_EQUAL_INT_NUM", "GREATER_INT_NUM", "GREATER_EQUAL_INT_NUM", "LESS_INT_NUM", "LESS_EQUAL_INT_NUM",
 };
 
 string OperationCodeName(OperationCode code)
@@ -42,9 +78,9 @@ string InlineStack(VM* vm)
 string FrameS(Frame* frame)
 {
 	string r = "frame\n";
-	for (auto i : frame->locals)
+	for (int i = 0; i < frame->locals_count; i++)
 	{
-		string value = i.ToString();
+		string value = frame->locals[i].ToString();
 		r += value + "\n";
 	}
 	if (frame->previous != nullptr)
@@ -52,11 +88,49 @@ string FrameS(Frame* frame)
 	return r;
 }
 
+// Operations that keep being deoptimized are left generic.
+const int QUICKEN_LIMIT = 4;
+
+// Back-edge executions after which a loop body is optimized.
+const int HOT_LOOP = 64;
+
+// Values kept free above the locals of a call for the temporaries of its code.
+const int STACK_RESERVE = 256;
+
+bool AddOverflows(long long a, long long b)
+{
+	return (b > 0 && a > LLONG_MAX - b) || (b < 0 && a < LLONG_MIN - b);
+}
+
+bool SubtractOverflows(long long a, long long b)
+{
+	return (b < 0 && a > LLONG_MAX + b) || (b > 0 && a < LLONG_MIN + b);
+}
+
+bool MultiplyOverflows(long long a, long long b)
+{
+	if (a > 0)
+		return b > 0 ? a > LLONG_MAX / b : b < LLONG_MIN / a;
+	if (b > 0)
+		return a < LLONG_MIN / b;
+	return a != 0 && b < LLONG_MAX / a;
+}
+
+bool DivideOverflows(long long a, long long b)
+{
+	return b == 0 || (a == LLONG_MIN && b == -1);
+}
+
 bool cstrcmp::operator()(const char* lhs, const char* rhs) const { return std::strcmp(lhs, rhs) < 0; }
+bool cstrcmp::operator()(const char* lhs, string_view rhs) const { return rhs.compare(lhs) > 0; }
+bool cstrcmp::operator()(string_view lhs, const char* rhs) const { return lhs.compare(rhs) < 0; }
 
-VM::VM(Assembly& assembly) : assembly(assembly), stack_size(1024 * 1024 / sizeof(Value))
+VM::VM(Assembly& assembly, ConstantPool* constants)
+	: assembly(assembly), operations(assembly.operations), stack_size(1024 * 1024 / sizeof(Value)), constants(constants), output(1)
 {
-	size = static_cast<int>(assembly.operations.size());
+	size = static_cast<int>(operations.size());
+	code = operations.data();
+	current = 0;
 	stack = new Value[stack_size];
 
 	frames_pool_size = 1024;
@@ -69,7 +143,23 @@ VM::VM(Assembly& assembly) : assembly(assembly), stack_size(1024 * 1024 / sizeof
 	pointer = stack;
 }
 
-VM::~VM() { delete stack; delete frames_pool; for (auto i : globals) if (i.second.type == V_OBJECT) delete i.second.as.object; }
+VM::~VM()
+{
+	// Stopped inside a coroutine, the main program is at the bottom of its resumers.
+	while (running != nullptr) {
+		Load(running->caller);
+		running = running->resumer;
+	}
+	delete[] stack;
+	delete[] frames_pool;
+	while (objects != nullptr) {
+		Object* previous = objects->gc_info.previous;
+		delete objects;
+		objects = previous;
+	}
+	for (auto i : natives)
+		delete i;
+}
 
 void VM::Run()	
 {
@@ -78,7 +168,7 @@ void VM::Run()
 
 	while (!End()) {
 		//int c = current;
-		Operation operation = Advance();
+		Operation& operation = Advance();
 		
 		// cout << c << " " << OperationCodeName(operation.code) << " " << (operation.value.ToString()) << ' ' << InlineStack(this) << endl;
 		// cout << FrameS(frame) << endl;
@@ -88,25 +178,73 @@ void VM::Run()
 		{
 		case OP_GET_SELF:
 		{
-			Push(callee->self);
+			Push(call_frame != nullptr ? call_frame->self : Value());
+		}
+		break;
+		case OP_INVOKE:
+		{
+			Value receiver = Pop();
+			Value method;
+			if (receiver.type == V_OBJECT && receiver.as.object->type == OT_TABLE) {
+				auto table = static_cast<ValueTableObject*>(receiver.as.object);
+				method = LookupMethod(operation, table);
+				if (method.type == V_NIL && table->HasMetamethod(MM_INDEX))
+					method = IndexMethod(table, operation.value.as.c_str);
+			}
+
+			if (method.type == V_OBJECT && method.as.object->type == OT_FUNCTION)
+				Invoke(static_cast<FunctionObject*>(method.as.object), receiver, operation.argument);
+			else if (method.type == V_OBJECT)
+				method.as.object->Operate(this, Operation(OP_CALL, operation.argument));
+			else {
+				pointer -= operation.argument;
+				Push(Value());
+			}
 		}
 		break;
 		case OP_LOAD_CLOSURE:
 		{
-			Push(callee->closures[operation.value.as.integer]);
+			Push(*call_frame->callee->Closures()[operation.value.as.integer]->location);
 		}
 		break;
 		case OP_STORE_CLOSURE:
 		{
-			auto value = Pop();
-			static_cast<FunctionObject*>(Peek().as.object)->closures.push_back(value);
+			*call_frame->callee->Closures()[operation.value.as.integer]->location = Pop();
+		}
+		break;
+		case OP_CAPTURE_FAST:
+		{
+			Push(CaptureUpvalue(frame->GetPrevious(operation.value.as.double16.b), operation.value.as.double16.a));
+		}
+		break;
+		case OP_CAPTURE_CLOSURE:
+		{
+			Push(call_frame->callee->Closures()[operation.value.as.integer]);
+		}
+		break;
+		case OP_CAPTURE_VALUE:
+		{
+			auto upvalue = new UpvalueObject(nullptr, nullptr);
+			NewObject(upvalue);
+			upvalue->closed = Pop();
+			upvalue->location = &upvalue->closed;
+			Push(upvalue);
 		}
 		break;
 		case OP_MAKE_FUNCTION:
 		{
-			auto f = new FunctionObject();
-			f->begin = operation.value.as.integer;
+			int closures_count = operation.value.as.double16.b;
+			auto f = FunctionObject::Make(closures_count);
+			f->begin = operation.argument;
+			f->locals_count = operation.value.as.double16.a;
+			f->frame = frame;
+			f->owner = running;
 			NewObject(f);
+
+			Value* cells = pointer - closures_count + 1;
+			for (int i = 0; i < closures_count; i++)
+				f->Closures()[i] = static_cast<UpvalueObject*>(cells[i].as.object);
+			pointer -= closures_count;
 			Push(f);
 		}
 		break;
@@ -115,8 +253,15 @@ void VM::Run()
 			ValueTableObject* meta = static_cast<ValueTableObject*>(Pop().as.object);
 			ValueTableObject* table = static_cast<ValueTableObject*>(Peek().as.object);
 			table->meta = meta;
+			table->version++;
 		}
 		break;
+		case OP_PUSH_STRING:
+			// The literal is made once, then the operation pushes it directly.
+			operation.value = Value(Intern(operation.value.as.c_str));
+			operation.code = OP_PUSH;
+			Push(operation.value);
+			break;
 		case OP_NEW_OBJ:
 		{
 			Object* object;
@@ -141,29 +286,76 @@ void VM::Run()
 			break;
 		case OP_RETURN:
 		{
-			while (frame->return_address == -1 && frame->previous != nullptr) {
-				Frame* previous = frame->previous;
-				ReturnFrame(frame);
-				frame = previous;
+			Frame* returning = call_frame;
+			if (returning == nullptr) {
+				current = size;
+				break;
+			}
+
+			// A return without a value still leaves nil for the caller.
+			Value result;
+			if (operation.value.as.boolean)
+				result = Peek();
+			CloseUpvalues(returning);
+			pointer = returning->base - 1;
+
+			// Only the first frame of a coroutine has no caller.
+			if (returning->caller == nullptr) {
+				if (Suspend(result, true))
+					return;
+				break;
 			}
-			current = frame->return_address;
-			frame->return_address = -1;
-			if (exit_on_return)
+			Push(result);
+
+			current = returning->return_address;
+			frame = returning->caller;
+			call_frame = returning->previous_call;
+			frames_pool_pointer = returning;
+			if (returning == exit_frame)
 				return;
 		}
 			break;
+		case OP_CALL:
+		{
+			Value value = Pop();
+			if (value.type == V_OBJECT && value.as.object->type == OT_FUNCTION)
+				Invoke(static_cast<FunctionObject*>(value.as.object), Value(), static_cast<int>(operation.value.as.integer));
+			else if (value.type == V_OBJECT)
+				value.as.object->Operate(this, operation);
+			else {
+				pointer -= operation.value.as.integer;
+				Push(Value());
+			}
+		}
+			break;
+		case OP_TAIL_CALL:
+		{
+			Value value = Pop();
+			if (value.type == V_OBJECT && value.as.object->type == OT_FUNCTION && call_frame != nullptr)
+				TailInvoke(static_cast<FunctionObject*>(value.as.object), operation.value.as.integer);
+			else if (value.type == V_OBJECT)
+				value.as.object->Operate(this, Operation(OP_CALL, operation.value));
+			else {
+				pointer -= operation.value.as.integer;
+				Push(Value());
+			}
+		}
+			break;
 		case OP_ADD_FRAME:
 		{
-			Frame* old = frame;
-			frame = PullFrame();
-			frame->vm = this;
-			frame->previous = old;
+			Frame* f = PullFrame();
+			if (f == nullptr)
+				break;
+			f->vm = this;
+			f->previous = frame;
+			frame = f;
 		}
 			break;
 		case OP_POP_FRAME:
 		{
 			if (frame->previous != nullptr) {
 				Frame* previous = frame->previous;
+				CloseUpvalues(frame);
 				ReturnFrame(frame);
 				frame = previous;
 			}
@@ -175,20 +367,56 @@ void VM::Run()
 
 			if (operation.value.type == V_CSTRING)
 			{
-				Value v = Pop();
-				ValueTableObject* obj = static_cast<ValueTableObject*>(v.as.object);
+				ValueTableObject* obj = static_cast<ValueTableObject*>(Peek().as.object);
 				result = obj->GetValue(operation.value.as.c_str);
-
-				if (result.type == V_OBJECT && result.as.object->type == OT_FUNCTION) {
-					auto f = (static_cast<FunctionObject*>(result.as.object));
-					f->self = obj;
+				if (result.type == V_NIL && obj->type == OT_TABLE && obj->HasMetamethod(MM_INDEX)) {
+					// The table stays on the stack, and so rooted, while the key is allocated.
+					auto key = new StringObject(operation.value.as.c_str);
+					NewObject(key);
+					*pointer = Value(key);
+					if (obj->CallMetamethod(this, MM_INDEX, 1))
+						break;
 				}
+				Pop();
 			}
 			else
 			{
-				auto obj = (static_cast<ValueVectorObject*>(Pop().as.object));
-				auto at = ((int)Pop().as.number);
-				result = obj->vector.at(at);
+				auto object = Pop().as.object;
+				auto key = Pop();
+				auto at = ((int)key.ToInteger());
+				if (object->type == OT_TABLE) {
+					auto table = static_cast<ValueTableObject*>(object);
+					result = table->Get(key);
+					if (result.type == V_NIL && table->HasMetamethod(MM_INDEX)) {
+						Push(key);
+						if (table->CallMetamethod(this, MM_INDEX, 1))
+							break;
+						Pop();
+					}
+				}
+				else if (IsTypedArray(object->type)) {
+					auto array = static_cast<TypedArrayObject*>(object);
+					if (at >= 0 && at < array->length)
+						result = array->Get(at);
+					else
+						cout << "Error: index " << at << " out of range." << endl;
+				}
+				else if (object->type == OT_STRING) {
+					auto string = static_cast<StringObject*>(object);
+					if (at >= 0 && at < static_cast<int>(string->Length()))
+						result = Value(static_cast<int>(string->Data()[at]));
+					else
+						cout << "Error: index " << at << " out of range." << endl;
+				}
+				else if (object->type == OT_MAPPED_FILE) {
+					auto file = static_cast<MappedFileObject*>(object);
+					if (at >= 0 && static_cast<size_t>(at) < file->size)
+						result = Value(static_cast<int>(static_cast<unsigned char>(file->data[at])));
+					else
+						cout << "Error: index " << at << " out of range." << endl;
+				}
+				else
+					result = static_cast<ValueVectorObject*>(object)->vector.at(at);
 			} 
 
 			Push(result);
@@ -203,19 +431,46 @@ void VM::Run()
 
 				auto obj = static_cast<ValueTableObject*>(Peek().as.object);
 
-				obj->table[index] = value;
-			} else if (operation.value.type == V_NUMBER)
+				obj->SetValue(index, value);
+			} else if (operation.value.IsNumeric())
 			{
-				auto index = (int)Pop().as.number;
+				auto key = Pop();
+				auto index = (int)key.ToInteger();
 				auto value = Pop();
-				auto obj = static_cast<ValueVectorObject*>(Peek().as.object);
-
-				obj->vector[index] = value;
+				auto object = Peek().as.object;
+
+				if (object->type == OT_TABLE)
+					static_cast<ValueTableObject*>(object)->Set(key, value);
+				else if (IsTypedArray(object->type)) {
+					auto array = static_cast<TypedArrayObject*>(object);
+					if (index >= 0 && index < array->length)
+						array->Set(index, value);
+					else
+						cout << "Error: index " << index << " out of range." << endl;
+				}
+				else if (object->type == OT_STRING) {
+					auto string = static_cast<StringObject*>(object);
+					if (string->constant)
+						cout << "Error: string literal cannot be changed." << endl;
+					else if (index >= 0 && index < static_cast<int>(string->Length()))
+						string->Set(index, static_cast<char>(value.ToInteger()));
+					else
+						cout << "Error: index " << index << " out of range." << endl;
+				}
+				else if (object->type == OT_MAPPED_FILE)
+					cout << "Error: mapped file cannot be changed." << endl;
+				else
+					static_cast<ValueVectorObject*>(object)->Set(index, value);
 			} else {
 				auto value = Pop();
-				auto obj = static_cast<ValueVectorObject*>(Peek().as.object);
+				auto object = Peek().as.object;
 
-				obj->vector.push_back(value);
+				if (object->type != OT_STRING)
+					static_cast<ValueVectorObject*>(object)->Push(value);
+				else if (static_cast<StringObject*>(object)->constant)
+					cout << "Error: string literal cannot be changed." << endl;
+				else
+					static_cast<StringObject*>(object)->Append(string(1, static_cast<char>(value.ToInteger())));
 			}
 		}
 			break;
@@ -225,6 +480,12 @@ void VM::Run()
 		case OP_STORE_NAME:
 			globals[operation.value.as.c_str] = Pop();
 			break;
+		case OP_LOAD_GLOBAL:
+			Push(*global_slots[operation.value.as.integer]);
+			break;
+		case OP_STORE_GLOBAL:
+			*global_slots[operation.value.as.integer] = Pop();
+			break;
 		case OP_LOAD_FAST:
 			Push(frame->GetPrevious(operation.value.as.double16.b)->GetLocal(operation.value.as.double16.a));
 			break;
@@ -245,64 +506,344 @@ void VM::Run()
 				current = operation.value.as.integer;
 			break;
 		case OP_JUMP:
+			// Counts up to HOT_LOOP once and then stays there.
+			if (operation.value.as.integer < current && operation.counter < HOT_LOOP && ++operation.counter == HOT_LOOP)
+				OptimizeLoop(operation.value.as.integer, current - 1);
 			current = operation.value.as.integer;
 			break;
+		case OP_ADD_NUM:
+			if (!NumberOperands()) { Deoptimize(OP_ADD); break; }
+			pointer[-1] = Value(pointer->as.number + pointer[-1].as.number);
+			pointer--;
+			break;
+		case OP_SUBTRACT_NUM:
+			if (!NumberOperands()) { Deoptimize(OP_SUBTRACT); break; }
+			pointer[-1] = Value(pointer->as.number - pointer[-1].as.number);
+			pointer--;
+			break;
+		case OP_MULTIPLY_NUM:
+			if (!NumberOperands()) { Deoptimize(OP_MULTIPLY); break; }
+			pointer[-1] = Value(pointer->as.number * pointer[-1].as.number);
+			pointer--;
+			break;
+		case OP_DIVIDE_NUM:
+			if (!NumberOperands()) { Deoptimize(OP_DIVIDE); break; }
+			pointer[-1] = Value(pointer->as.number / pointer[-1].as.number);
+			pointer--;
+			break;
+		case OP_EQUAL_NUM:
+			if (!NumberOperands()) { Deoptimize(OP_EQUAL); break; }
+			pointer[-1] = Value(pointer->as.number == pointer[-1].as.number);
+			pointer--;
+			break;
+		case OP_NOT_EQUAL_NUM:
+			if (!NumberOperands()) { Deoptimize(OP_NOT_EQUAL); break; }
+			pointer[-1] = Value(pointer->as.number != pointer[-1].as.number);
+			pointer--;
+			break;
+		case OP_GREATER_NUM:
+			if (!NumberOperands()) { Deoptimize(OP_GREATER); break; }
+			pointer[-1] = Value(pointer->as.number > pointer[-1].as.number);
+			pointer--;
+			break;
+		case OP_GREATER_EQUAL_NUM:
+			if (!NumberOperands()) { Deoptimize(OP_GREATER_EQUAL); break; }
+			pointer[-1] = Value(pointer->as.number >= pointer[-1].as.number);
+			pointer--;
+			break;
+		case OP_LESS_NUM:
+			if (!NumberOperands()) { Deoptimize(OP_LESS); break; }
+			pointer[-1] = Value(pointer->as.number < pointer[-1].as.number);
+			pointer--;
+			break;
+		case OP_LESS_EQUAL_NUM:
+			if (!NumberOperands()) { Deoptimize(OP_LESS_EQUAL); break; }
+			pointer[-1] = Value(pointer->as.number <= pointer[-1].as.number);
+			pointer--;
+			break;
+		case OP_ADD_STR:
+		{
+			if (pointer->type != V_OBJECT || pointer->as.object->type != OT_STRING) { Deoptimize(OP_ADD); break; }
+			auto string = static_cast<StringObject*>(Peek().as.object)->Concat(this, pointer[-1]);
+			pointer -= 2;
+			Push(string);
+		}
+			break;
+		case OP_ADD_INT:
+			if (!IntegerOperands() || AddOverflows(pointer->as.integer, pointer[-1].as.integer)) { Deoptimize(OP_ADD); break; }
+			pointer[-1] = Value(pointer->as.integer + pointer[-1].as.integer);
+			pointer--;
+			break;
+		case OP_SUBTRACT_INT:
+			if (!IntegerOperands() || SubtractOverflows(pointer->as.integer, pointer[-1].as.integer)) { Deoptimize(OP_SUBTRACT); break; }
+			pointer[-1] = Value(pointer->as.integer - pointer[-1].as.integer);
+			pointer--;
+			break;
+		case OP_MULTIPLY_INT:
+			if (!IntegerOperands() || MultiplyOverflows(pointer->as.integer, pointer[-1].as.integer)) { Deoptimize(OP_MULTIPLY); break; }
+			pointer[-1] = Value(pointer->as.integer * pointer[-1].as.integer);
+			pointer--;
+			break;
+		case OP_MOD_INT:
+			if (!IntegerOperands() || DivideOverflows(pointer->as.integer, pointer[-1].as.integer)) { Deoptimize(OP_MOD); break; }
+			pointer[-1] = Value(pointer->as.integer % pointer[-1].as.integer);
+			pointer--;
+			break;
+		case OP_DIV_INT:
+			if (!IntegerOperands() || DivideOverflows(pointer->as.integer, pointer[-1].as.integer)) { Deoptimize(OP_DIV); break; }
+			pointer[-1] = Value(pointer->as.integer / pointer[-1].as.integer);
+			pointer--;
+			break;
+		case OP_EQUAL_INT:
+			if (!IntegerOperands()) { Deoptimize(OP_EQUAL); break; }
+			pointer[-1] = Value(pointer->as.integer == pointer[-1].as.integer);
+			pointer--;
+			break;
+		case OP_NOT_EQUAL_INT:
+			if (!IntegerOperands()) { Deoptimize(OP_NOT_EQUAL); break; }
+			pointer[-1] = Value(pointer->as.integer != pointer[-1].as.integer);
+			pointer--;
+			break;
+		case OP_GREATER_INT:
+			if (!IntegerOperands()) { Deoptimize(OP_GREATER); break; }
+			pointer[-1] = Value(pointer->as.integer > pointer[-1].as.integer);
+			pointer--;
+			break;
+		case OP_GREATER_EQUAL_INT:
+			if (!IntegerOperands()) { Deoptimize(OP_GREATER_EQUAL); break; }
+			pointer[-1] = Value(pointer->as.integer >= pointer[-1].as.integer);
+			pointer--;
+			break;
+		case OP_LESS_INT:
+			if (!IntegerOperands()) { Deoptimize(OP_LESS); break; }
+			pointer[-1] = Value(pointer->as.integer < pointer[-1].as.integer);
+			pointer--;
+			break;
+		case OP_LESS_EQUAL_INT:
+			if (!IntegerOperands()) { Deoptimize(OP_LESS_EQUAL); break; }
+			pointer[-1] = Value(pointer->as.integer <= pointer[-1].as.integer);
+			pointer--;
+			break;
+		case OP_ADD_NUM_INT:
+			if (!NumberIntegerOperands()) { Deoptimize(OP_ADD); break; }
+			pointer[-1] = Value(pointer->as.number + static_cast<double>(pointer[-1].as.integer));
+			pointer--;
+			break;
+		case OP_SUBTRACT_NUM_INT:
+			if (!NumberIntegerOperands()) { Deoptimize(OP_SUBTRACT); break; }
+			pointer[-1] = Value(pointer->as.number - static_cast<double>(pointer[-1].as.integer));
+			pointer--;
+			break;
+		case OP_MULTIPLY_NUM_INT:
+			if (!NumberIntegerOperands()) { Deoptimize(OP_MULTIPLY); break; }
+			pointer[-1] = Value(pointer->as.number * static_cast<double>(pointer[-1].as.integer));
+			pointer--;
+			break;
+		case OP_DIVIDE_NUM_INT:
+			if (!NumberIntegerOperands()) { Deoptimize(OP_DIVIDE); break; }
+			pointer[-1] = Value(pointer->as.number / static_cast<double>(pointer[-1].as.integer));
+			pointer--;
+			break;
+		case OP_EQUAL_NUM_INT:
+			if (!NumberIntegerOperands()) { Deoptimize(OP_EQUAL); break; }
+			pointer[-1] = Value(pointer->as.number == static_cast<double>(pointer[-1].as.integer));
+			pointer--;
+			break;
+		case OP_NOT_EQUAL_NUM_INT:
+			if (!NumberIntegerOperands()) { Deoptimize(OP_NOT_EQUAL); break; }
+			pointer[-1] = Value(pointer->as.number != static_cast<double>(pointer[-1].as.integer));
+			pointer--;
+			break;
+		case OP_GREATER_NUM_INT:
+			if (!NumberIntegerOperands()) { Deoptimize(OP_GREATER); break; }
+			pointer[-1] = Value(pointer->as.number > static_cast<double>(pointer[-1].as.integer));
+			pointer--;
+			break;
+		case OP_GREATER_EQUAL_NUM_INT:
+			if (!NumberIntegerOperands()) { Deoptimize(OP_GREATER_EQUAL); break; }
+			pointer[-1] = Value(pointer->as.number >= static_cast<double>(pointer[-1].as.integer));
+			pointer--;
+			break;
+		case OP_LESS_NUM_INT:
+			if (!NumberIntegerOperands()) { Deoptimize(OP_LESS); break; }
+			pointer[-1] = Value(pointer->as.number < static_cast<double>(pointer[-1].as.integer));
+			pointer--;
+			break;
+		case OP_LESS_EQUAL_NUM_INT:
+			if (!NumberIntegerOperands()) { Deoptimize(OP_LESS_EQUAL); break; }
+			pointer[-1] = Value(pointer->as.number <= static_cast<double>(pointer[-1].as.integer));
+			pointer--;
+			break;
+		case OP_ADD_INT_NUM:
+			if (!IntegerNumberOperands()) { Deoptimize(OP_ADD); break; }
+			pointer[-1] = Value(static_cast<double>(pointer->as.integer) + pointer[-1].as.number);
+			pointer--;
+			break;
+		case OP_SUBTRACT_INT_NUM:
+			if (!IntegerNumberOperands()) { Deoptimize(OP_SUBTRACT); break; }
+			pointer[-1] = Value(static_cast<double>(pointer->as.integer) - pointer[-1].as.number);
+			pointer--;
+			break;
+		case OP_MULTIPLY_INT_NUM:
+			if (!IntegerNumberOperands()) { Deoptimize(OP_MULTIPLY); break; }
+			pointer[-1] = Value(static_cast<double>(pointer->as.integer) * pointer[-1].as.number);
+			pointer--;
+			break;
+		case OP_DIVIDE_INT_NUM:
+			if (!IntegerNumberOperands()) { Deoptimize(OP_DIVIDE); break; }
+			pointer[-1] = Value(static_cast<double>(pointer->as.integer) / pointer[-1].as.number);
+			pointer--;
+			break;
+		case OP_EQUAL_INT_NUM:
+			if (!IntegerNumberOperands()) { Deoptimize(OP_EQUAL); break; }
+			pointer[-1] = Value(static_cast<double>(pointer->as.integer) == pointer[-1].as.number);
+			pointer--;
+			break;
+		case OP_NOT_EQUAL_INT_NUM:
+			if (!IntegerNumberOperands()) { Deoptimize(OP_NOT_EQUAL); break; }
+			pointer[-1] = Value(static_cast<double>(pointer->as.integer) != pointer[-1].as.number);
+			pointer--;
+			break;
+		case OP_GREATER_INT_NUM:
+			if (!IntegerNumberOperands()) { Deoptimize(OP_GREATER); break; }
+			pointer[-1] = Value(static_cast<double>(pointer->as.integer) > pointer[-1].as.number);
+			pointer--;
+			break;
+		case OP_GREATER_EQUAL_INT_NUM:
+			if (!IntegerNumberOperands()) { Deoptimize(OP_GREATER_EQUAL); break; }
+			pointer[-1] = Value(static_cast<double>(pointer->as.integer) >= pointer[-1].as.number);
+			pointer--;
+			break;
+		case OP_LESS_INT_NUM:
+			if (!IntegerNumberOperands()) { Deoptimize(OP_LESS); break; }
+			pointer[-1] = Value(static_cast<double>(pointer->as.integer) < pointer[-1].as.number);
+			pointer--;
+			break;
+		case OP_LESS_EQUAL_INT_NUM:
+			if (!IntegerNumberOperands()) { Deoptimize(OP_LESS_EQUAL); break; }
+			pointer[-1] = Value(static_cast<double>(pointer->as.integer) <= pointer[-1].as.number);
+			pointer--;
+			break;
+		case OP_TEST_EQUAL_NUM:
+			if (!NumberOperands()) { Deoptimize(OP_EQUAL_NUM); break; }
+			Branch(pointer->as.number == pointer[-1].as.number);
+			break;
+		case OP_TEST_NOT_EQUAL_NUM:
+			if (!NumberOperands()) { Deoptimize(OP_NOT_EQUAL_NUM); break; }
+			Branch(pointer->as.number != pointer[-1].as.number);
+			break;
+		case OP_TEST_GREATER_NUM:
+			if (!NumberOperands()) { Deoptimize(OP_GREATER_NUM); break; }
+			Branch(pointer->as.number > pointer[-1].as.number);
+			break;
+		case OP_TEST_GREATER_EQUAL_NUM:
+			if (!NumberOperands()) { Deoptimize(OP_GREATER_EQUAL_NUM); break; }
+			Branch(pointer->as.number >= pointer[-1].as.number);
+			break;
+		case OP_TEST_LESS_NUM:
+			if (!NumberOperands()) { Deoptimize(OP_LESS_NUM); break; }
+			Branch(pointer->as.number < pointer[-1].as.number);
+			break;
+		case OP_TEST_LESS_EQUAL_NUM:
+			if (!NumberOperands()) { Deoptimize(OP_LESS_EQUAL_NUM); break; }
+			Branch(pointer->as.number <= pointer[-1].as.number);
+			break;
+		case OP_TEST_EQUAL_INT:
+			if (!IntegerOperands()) { Deoptimize(OP_EQUAL_INT); break; }
+			Branch(pointer->as.integer == pointer[-1].as.integer);
+			break;
+		case OP_TEST_NOT_EQUAL_INT:
+			if (!IntegerOperands()) { Deoptimize(OP_NOT_EQUAL_INT); break; }
+			Branch(pointer->as.integer != pointer[-1].as.integer);
+			break;
+		case OP_TEST_GREATER_INT:
+			if (!IntegerOperands()) { Deoptimize(OP_GREATER_INT); break; }
+			Branch(pointer->as.integer > pointer[-1].as.integer);
+			break;
+		case OP_TEST_GREATER_EQUAL_INT:
+			if (!IntegerOperands()) { Deoptimize(OP_GREATER_EQUAL_INT); break; }
+			Branch(pointer->as.integer >= pointer[-1].as.integer);
+			break;
+		case OP_TEST_LESS_INT:
+			if (!IntegerOperands()) { Deoptimize(OP_LESS_INT); break; }
+			Branch(pointer->as.integer < pointer[-1].as.integer);
+			break;
+		case OP_TEST_LESS_EQUAL_INT:
+			if (!IntegerOperands()) { Deoptimize(OP_LESS_EQUAL_INT); break; }
+			Branch(pointer->as.integer <= pointer[-1].as.integer);
+			break;
+		case OP_LEN:
+		{
+			Value value = Pop();
+			Value result;
+			if (value.type == V_OBJECT) {
+				auto object = value.as.object;
+				if (object->type == OT_TABLE) {
+					auto table = static_cast<ValueTableObject*>(object);
+					if (table->CallMetamethod(this, MM_LEN, 0))
+						break;
+					result = Value(static_cast<long long>(table->array.size()));
+				}
+				else if (object->type == OT_ARRAY)
+					result = Value(static_cast<long long>(static_cast<ValueVectorObject*>(object)->vector.size()));
+				else if (object->type == OT_STRING)
+					result = Value(static_cast<long long>(static_cast<StringObject*>(object)->Length()));
+				else if (object->type == OT_MAPPED_FILE)
+					result = Value(static_cast<long long>(static_cast<MappedFileObject*>(object)->size));
+				else if (IsTypedArray(object->type))
+					result = Value(static_cast<long long>(static_cast<TypedArrayObject*>(object)->length));
+			}
+			Push(result);
+		}
+			break;
+		case OP_YIELD:
+		{
+			Value value = Pop();
+			// A nested Run of a native call would go on in the resumer's code.
+			if (running == nullptr || exit_frame != nullptr) {
+				cout << (running == nullptr ? "Error: yield outside a coroutine." : "Error: cannot yield across a native call.") << endl;
+				if (operation.value.as.boolean)
+					Push(Value());
+				break;
+			}
+			running->push_result = operation.value.as.boolean;
+			if (Suspend(value, false))
+				return;
+		}
+			break;
+		case OP_RESUME:
+		{
+			Value value = Pop();
+			if (value.type == V_OBJECT && value.as.object->type == OT_COROUTINE)
+				Resume(static_cast<CoroutineObject*>(value.as.object), static_cast<int>(operation.value.as.integer), false);
+			else {
+				cout << "Error: resume expects a coroutine." << endl;
+				pointer -= operation.value.as.integer;
+				Push(Value());
+			}
+		}
+			break;
 		default:
+			Operation generic = operation;
+			Quicken(operation);
+
 			Value value = Pop();
 
+			if (MetamethodOf(generic.code) >= 0 && generic.code != OP_NEGATE && BinaryMetamethod(generic.code, value))
+				break;
 			if (value.type == V_OBJECT)
-				value.as.object->Operate(this, operation);
-
-			if (value.type == V_NUMBER)
-			{
-				switch (operation.code)
-				{
-				case OP_ADD:
-					Push(Value(value.as.number + Pop().as.number));
-					break;
-				case OP_SUBTRACT:
-					Push(Value(value.as.number - Pop().as.number));
-					break;
-				case OP_DIVIDE:
-					Push(Value(value.as.number / Pop().as.number));
-					break;
-				case OP_MULTIPLY:
-					Push(Value(value.as.number * Pop().as.number));
-					break;
-				case OP_NOT:
-					Push(Value(!value.as.number));
-					break;
-				case OP_NEGATE:
-					Push(Value(-value.as.number));
-					break;
-				case OP_EQUAL:
-					Push(Value(value.as.number == Pop().as.number));
-					break;
-				case OP_NOT_EQUAL:
-					Push(Value(value.as.number != Pop().as.number));
-					break;
-				case OP_GREATER:
-					Push(Value(value.as.number > Pop().as.number));
-					break;
-				case OP_GREATER_EQUAL:
-					Push(Value(value.as.number >= Pop().as.number));
-					break;
-				case OP_LESS:
-					Push(Value(value.as.number < Pop().as.number));
-					break;
-				case OP_LESS_EQUAL:
-					Push(Value(value.as.number <= Pop().as.number));
-					break;
-				case OP_MOD:
-					Push(Value(div((int)value.as.number, (int)Pop().as.number).rem));
-					break;
-				case OP_DIV:
-					Push(Value(div((int)value.as.number, (int)Pop().as.number).quot));
-					break;
-				default:
-					break;
-				}
+				value.as.object->Operate(this, generic);
+			else if ((generic.code == OP_EQUAL || generic.code == OP_NOT_EQUAL) && !(value.IsNumeric() && Peek().IsNumeric())) {
+				// nil, bools and operands of different types compare by type and value.
+				bool equal = ValueEqual()(value, Pop());
+				Push(Value(generic.code == OP_EQUAL ? equal : !equal));
+				break;
 			}
+
+			if (value.type == V_INTEGER && (generic.code == OP_NOT || generic.code == OP_NEGATE || Peek().type == V_INTEGER))
+				IntegerOperate(value.as.integer, generic.code);
+			else if (value.IsNumeric())
+				NumberOperate(value.ToNumber(), generic.code);
 			break;
 		}
 
@@ -319,11 +860,118 @@ void VM::Run()
 	//}
 
 	CollectGarbage();
+	output.Flush();
+}
+
+void VM::IntegerOperate(long long value, OperationCode code)
+{
+	switch (code)
+	{
+	case OP_NOT:
+		Push(Value(!value));
+		return;
+	case OP_NEGATE:
+		if (value == LLONG_MIN)
+			Push(Value(-static_cast<double>(value)));
+		else
+			Push(Value(-value));
+		return;
+	default:
+		break;
+	}
+
+	long long other = Peek().as.integer;
+	bool overflows;
+	switch (code)
+	{
+	case OP_ADD: overflows = AddOverflows(value, other); break;
+	case OP_SUBTRACT: overflows = SubtractOverflows(value, other); break;
+	case OP_MULTIPLY: overflows = MultiplyOverflows(value, other); break;
+	case OP_MOD: case OP_DIV: overflows = DivideOverflows(value, other); break;
+	case OP_DIVIDE: overflows = true; break;
+	default: overflows = false; break;
+	}
+
+	if (overflows)
+	{
+		NumberOperate(static_cast<double>(value), code);
+		return;
+	}
+
+	Pop();
+	switch (code)
+	{
+	case OP_ADD: Push(Value(value + other)); break;
+	case OP_SUBTRACT: Push(Value(value - other)); break;
+	case OP_MULTIPLY: Push(Value(value * other)); break;
+	case OP_MOD: Push(Value(value % other)); break;
+	case OP_DIV: Push(Value(value / other)); break;
+	case OP_EQUAL: Push(Value(value == other)); break;
+	case OP_NOT_EQUAL: Push(Value(value != other)); break;
+	case OP_GREATER: Push(Value(value > other)); break;
+	case OP_GREATER_EQUAL: Push(Value(value >= other)); break;
+	case OP_LESS: Push(Value(value < other)); break;
+	case OP_LESS_EQUAL: Push(Value(value <= other)); break;
+	default: break;
+	}
+}
+
+void VM::NumberOperate(double value, OperationCode code)
+{
+	switch (code)
+	{
+	case OP_ADD:
+		Push(Value(value + Pop().ToNumber()));
+		break;
+	case OP_SUBTRACT:
+		Push(Value(value - Pop().ToNumber()));
+		break;
+	case OP_DIVIDE:
+		Push(Value(value / Pop().ToNumber()));
+		break;
+	case OP_MULTIPLY:
+		Push(Value(value * Pop().ToNumber()));
+		break;
+	case OP_NOT:
+		Push(Value(!value));
+		break;
+	case OP_NEGATE:
+		Push(Value(-value));
+		break;
+	case OP_EQUAL:
+		Push(Value(value == Pop().ToNumber()));
+		break;
+	case OP_NOT_EQUAL:
+		Push(Value(value != Pop().ToNumber()));
+		break;
+	case OP_GREATER:
+		Push(Value(value > Pop().ToNumber()));
+		break;
+	case OP_GREATER_EQUAL:
+		Push(Value(value >= Pop().ToNumber()));
+		break;
+	case OP_LESS:
+		Push(Value(value < Pop().ToNumber()));
+		break;
+	case OP_LESS_EQUAL:
+		Push(Value(value <= Pop().ToNumber()));
+		break;
+	case OP_MOD:
+		Push(Value(fmod(value, Pop().ToNumber())));
+		break;
+	case OP_DIV:
+		Push(Value(trunc(value / Pop().ToNumber())));
+		break;
+	default:
+		break;
+	}
 }
 
 void VM::Add(const char* name, Value value)
 {
 	globals[name] = value;
+	if (value.type == V_OBJECT)
+		natives.push_back(value.as.object);
 }
 
 Value VM::GetParameter(int index)
@@ -352,10 +1000,18 @@ void VM::NewObject(Object* object)
 	objects = object;
 }
 
+// A free frame, nullptr when there is no room for one.
 Frame* VM::PullFrame()
 {
+	if (frames_pool_pointer < frames_pool && (running == nullptr || !running->GrowFrames(this)))
+	{
+		Overflow("call stack overflow (" + to_string(frames_pool_size) + " frames)");
+		return nullptr;
+	}
+
 	Frame* f = frames_pool_pointer--;
 
+	f->locals = f->storage;
 	f->locals_count = 0;
 	f->return_address = -1;
 	f->previous = nullptr;
@@ -372,6 +1028,9 @@ void VM::CollectGarbage()
 {
 	bytes_allocated = 0;
 
+	for (auto& i : invoke_caches)
+		i = InvokeCache();
+
 	if (objects != nullptr) {
 		Object* end = objects;
 		do
@@ -384,8 +1043,14 @@ void VM::CollectGarbage()
 	for (auto& i : globals)
 		MarkValue(i.second);
 
-	for (auto i = stack; i <= pointer; i++)
-		MarkValue(*i);
+	Context active;
+	Save(active);
+	MarkContext(active);
+	if (running != nullptr)
+		MarkObject(running);
+
+	for (auto& i : strings)
+		MarkObject(i.second);
 
 	if (objects_to_mark == nullptr)
 	{
@@ -421,6 +1086,24 @@ void VM::CollectGarbage()
 	}
 }
 
+void VM::MarkContext(Context& context)
+{
+	for (auto i = context.stack; i <= context.pointer; i++)
+		MarkValue(*i);
+
+	for (auto f = context.frames_pool_pointer + 1; f < context.frames_pool + context.frames_pool_size; f++)
+	{
+		for (int i = 0; i < f->locals_count; i++)
+			MarkValue(f->locals[i]);
+		MarkValue(f->self);
+		if (f->callee != nullptr)
+			MarkObject(f->callee);
+	}
+
+	for (auto i = context.open_upvalues; i != nullptr; i = i->next)
+		MarkObject(i);
+}
+
 void VM::MarkValue(Value value)
 {
 	if (value.type == V_OBJECT)
@@ -429,7 +1112,7 @@ void VM::MarkValue(Value value)
 
 void VM::MarkObject(Object* object)
 {
-	if (!object->gc_info.marked) {
+	if (!object->gc_info.marked && !object->gc_info.shared) {
 		object->gc_info.marked = true;
 		object->gc_info.previous_mark = objects_to_mark;
 		objects_to_mark = object;
@@ -438,9 +1121,485 @@ void VM::MarkObject(Object* object)
 	}
 }
 
-Operation VM::Advance()
+Operation& VM::Advance()
+{
+	return code[current++];
+}
+
+bool VM::NumberOperands()
+{
+	return pointer->type == V_NUMBER && pointer[-1].type == V_NUMBER;
+}
+
+bool VM::IntegerOperands()
+{
+	return pointer->type == V_INTEGER && pointer[-1].type == V_INTEGER;
+}
+
+bool VM::NumberIntegerOperands()
+{
+	return pointer->type == V_NUMBER && pointer[-1].type == V_INTEGER;
+}
+
+bool VM::IntegerNumberOperands()
 {
-	return assembly.operations.at(current++);
+	return pointer->type == V_INTEGER && pointer[-1].type == V_NUMBER;
+}
+
+void VM::Quicken(Operation& operation)
+{
+	if (operation.counter >= QUICKEN_LIMIT)
+		return;
+
+	if (operation.code == OP_ADD && pointer->type == V_OBJECT && pointer->as.object->type == OT_STRING)
+	{
+		operation.code = OP_ADD_STR;
+		return;
+	}
+
+	if (operation.code == OP_NOT || operation.code == OP_NEGATE)
+		return;
+
+	if (IntegerOperands())
+	{
+		switch (operation.code)
+		{
+		case OP_ADD: operation.code = OP_ADD_INT; break;
+		case OP_SUBTRACT: operation.code = OP_SUBTRACT_INT; break;
+		case OP_MULTIPLY: operation.code = OP_MULTIPLY_INT; break;
+		case OP_MOD: operation.code = OP_MOD_INT; break;
+		case OP_DIV: operation.code = OP_DIV_INT; break;
+		case OP_EQUAL: operation.code = OP_EQUAL_INT; break;
+		case OP_NOT_EQUAL: operation.code = OP_NOT_EQUAL_INT; break;
+		case OP_GREATER: operation.code = OP_GREATER_INT; break;
+		case OP_GREATER_EQUAL: operation.code = OP_GREATER_EQUAL_INT; break;
+		case OP_LESS: operation.code = OP_LESS_INT; break;
+		case OP_LESS_EQUAL: operation.code = OP_LESS_EQUAL_INT; break;
+		default: break;
+		}
+		return;
+	}
+
+	// An integer literal next to a double, as in x + 1, is as common as two
+	// doubles; the integer is widened without going through the generic path.
+	if (NumberIntegerOperands() || IntegerNumberOperands())
+	{
+		bool number_left = pointer->type == V_NUMBER;
+		switch (operation.code)
+		{
+		case OP_ADD: operation.code = number_left ? OP_ADD_NUM_INT : OP_ADD_INT_NUM; break;
+		case OP_SUBTRACT: operation.code = number_left ? OP_SUBTRACT_NUM_INT : OP_SUBTRACT_INT_NUM; break;
+		case OP_MULTIPLY: operation.code = number_left ? OP_MULTIPLY_NUM_INT : OP_MULTIPLY_INT_NUM; break;
+		case OP_DIVIDE: operation.code = number_left ? OP_DIVIDE_NUM_INT : OP_DIVIDE_INT_NUM; break;
+		case OP_EQUAL: operation.code = number_left ? OP_EQUAL_NUM_INT : OP_EQUAL_INT_NUM; break;
+		case OP_NOT_EQUAL: operation.code = number_left ? OP_NOT_EQUAL_NUM_INT : OP_NOT_EQUAL_INT_NUM; break;
+		case OP_GREATER: operation.code = number_left ? OP_GREATER_NUM_INT : OP_GREATER_INT_NUM; break;
+		case OP_GREATER_EQUAL: operation.code = number_left ? OP_GREATER_EQUAL_NUM_INT : OP_GREATER_EQUAL_INT_NUM; break;
+		case OP_LESS: operation.code = number_left ? OP_LESS_NUM_INT : OP_LESS_INT_NUM; break;
+		case OP_LESS_EQUAL: operation.code = number_left ? OP_LESS_EQUAL_NUM_INT : OP_LESS_EQUAL_INT_NUM; break;
+		default: break;
+		}
+		return;
+	}
+
+	if (!NumberOperands())
+		return;
+
+	switch (operation.code)
+	{
+	case OP_ADD: operation.code = OP_ADD_NUM; break;
+	case OP_SUBTRACT: operation.code = OP_SUBTRACT_NUM; break;
+	case OP_MULTIPLY: operation.code = OP_MULTIPLY_NUM; break;
+	case OP_DIVIDE: operation.code = OP_DIVIDE_NUM; break;
+	case OP_EQUAL: operation.code = OP_EQUAL_NUM; break;
+	case OP_NOT_EQUAL: operation.code = OP_NOT_EQUAL_NUM; break;
+	case OP_GREATER: operation.code = OP_GREATER_NUM; break;
+	case OP_GREATER_EQUAL: operation.code = OP_GREATER_EQUAL_NUM; break;
+	case OP_LESS: operation.code = OP_LESS_NUM; break;
+	case OP_LESS_EQUAL: operation.code = OP_LESS_EQUAL_NUM; break;
+	default: break;
+	}
+}
+
+void VM::OptimizeLoop(int begin, int end)
+{
+	// The loop is rewritten while it runs, so the live frame and stack carry
+	// over as they are and the next iteration already takes the optimized code.
+	// By now the loop body has been quickened by the types it actually saw,
+	// so a quickened comparison feeding a branch can test and jump at once.
+	// Globals are bound to their slots, which stay put for the VM lifetime.
+	for (int i = begin; i < end; i++)
+	{
+		Operation& operation = code[i];
+		if (operation.code == OP_LOAD_NAME || operation.code == OP_STORE_NAME)
+		{
+			operation.code = operation.code == OP_LOAD_NAME ? OP_LOAD_GLOBAL : OP_STORE_GLOBAL;
+			operation.value = Value(BindGlobal(operation.value.as.c_str));
+			continue;
+		}
+		if (code[i + 1].code != OP_JUMP_NOT_TEST)
+			continue;
+		if (operation.code >= OP_EQUAL_NUM && operation.code <= OP_LESS_EQUAL_NUM)
+			operation.code = static_cast<OperationCode>(OP_TEST_EQUAL_NUM + (operation.code - OP_EQUAL_NUM));
+		else if (operation.code >= OP_EQUAL_INT && operation.code <= OP_LESS_EQUAL_INT)
+			operation.code = static_cast<OperationCode>(OP_TEST_EQUAL_INT + (operation.code - OP_EQUAL_INT));
+	}
+}
+
+bool VM::Invoke(FunctionObject* function, Value self, int arguments_count)
+{
+	// The arguments already on the stack become the first locals of the
+	// callee; the rest of its locals are reserved right above them.
+	if (!StackRoom(pointer, function->locals_count + STACK_RESERVE))
+		return false;
+
+	Frame* f = PullFrame();
+	if (f == nullptr)
+		return false;
+	f->vm = this;
+	f->return_address = current;
+	f->callee = function;
+	f->self = self;
+	f->base = pointer - arguments_count + 1;
+	f->locals = f->base;
+	f->locals_count = function->locals_count;
+	f->caller = frame;
+	f->previous_call = call_frame;
+	f->previous = function->frame;
+
+	for (int i = arguments_count; i < function->locals_count; i++)
+		f->locals[i] = Value();
+	pointer = f->base + function->locals_count - 1;
+
+	frame = f;
+	call_frame = f;
+	current = function->begin;
+	return true;
+}
+
+Value VM::LookupMethod(Operation& operation, ValueTableObject* receiver)
+{
+	if (operation.counter == 0)
+	{
+		invoke_caches.push_back(InvokeCache());
+		operation.counter = static_cast<int>(invoke_caches.size());
+	}
+	InvokeCache& cache = invoke_caches[operation.counter - 1];
+	const char* name = operation.value.as.c_str;
+
+	if (cache.holder != nullptr && cache.holder->version == cache.holder_version)
+	{
+		if (cache.receiver == receiver && ChainVersion(receiver, cache.holder) == cache.chain_version)
+			return cache.method;
+		if (cache.holder == receiver->meta && receiver->table.find(name) == receiver->table.end())
+			return cache.method;
+	}
+
+	for (auto holder = receiver; holder != nullptr; holder = holder->meta)
+	{
+		auto found = holder->table.find(name);
+		if (found != holder->table.end())
+		{
+			cache.receiver = receiver;
+			cache.chain_version = ChainVersion(receiver, holder);
+			cache.holder = holder;
+			cache.holder_version = holder->version;
+			cache.method = found->second;
+			return cache.method;
+		}
+	}
+	return Value();
+}
+
+// A method missing from the meta chain is asked of __index, as o.name
+// would be. The answer is not cached, __index may give another each time.
+Value VM::IndexMethod(ValueTableObject* receiver, const char* name)
+{
+	Value index = receiver->GetMetamethod(MM_INDEX);
+	if (index.type != V_OBJECT || index.as.object->type != OT_FUNCTION)
+		return Value();
+
+	// The receiver is pushed to stay rooted while the key is allocated.
+	Push(receiver);
+	auto key = new StringObject(name);
+	NewObject(key);
+	Push(key);
+	static_cast<FunctionObject*>(index.as.object)->Call(receiver, 1);
+	Value method = Pop();
+	Pop();
+	return method;
+}
+
+// Calls the metamethod of a binary operation; the right operand is still
+// on the stack. The left table's own metamethod gets the right operand.
+// Otherwise the right table's reflected one gets the left operand, so
+// 3 - t calls t.__rsub(3) and 3 < t calls t.__gt(3). False when neither
+// table defines one.
+bool VM::BinaryMetamethod(OperationCode code, Value left)
+{
+	if (left.type == V_OBJECT && left.as.object->type == OT_TABLE
+		&& static_cast<ValueTableObject*>(left.as.object)->CallMetamethod(this, static_cast<Metamethod>(MetamethodOf(code)), 1))
+		return true;
+
+	Value right = Peek();
+	int method = ReflectedMetamethodOf(code);
+	if (method < 0 || right.type != V_OBJECT || right.as.object->type != OT_TABLE)
+		return false;
+	auto table = static_cast<ValueTableObject*>(right.as.object);
+	Value function = table->GetMetamethod(static_cast<Metamethod>(method));
+	if (function.type != V_OBJECT || function.as.object->type != OT_FUNCTION)
+		return false;
+
+	Pop();
+	Push(left);
+	Invoke(static_cast<FunctionObject*>(function.as.object), right, 1);
+	return true;
+}
+
+// Versions only grow, and a table's version also grows when its meta
+// changes, so the sum is unchanged only while no table between receiver
+// and holder has been stored to, including the ones that hide no method.
+unsigned VM::ChainVersion(ValueTableObject* receiver, ValueTableObject* holder)
+{
+	unsigned version = 0;
+	for (auto t = receiver; t != nullptr; t = t->meta) {
+		version += t->version;
+		if (t == holder)
+			break;
+	}
+	return version;
+}
+
+void VM::TailInvoke(FunctionObject* function, int arguments_count)
+{
+	// The current call frame is reused: its return address and caller stay,
+	// the new arguments move down to its base and any block frames are dropped.
+	Frame* f = call_frame;
+	// A function defined in this call still reads its frames, so it gets
+	// a frame of its own.
+	if (function->frame > frames_pool_pointer && function->frame <= f) {
+		Invoke(function, Value(), arguments_count);
+		return;
+	}
+	if (!StackRoom(f->base - 1, function->locals_count + STACK_RESERVE))
+		return;
+	CloseUpvalues(f);
+	Value* arguments = pointer - arguments_count + 1;
+	for (int i = 0; i < arguments_count; i++)
+		f->base[i] = arguments[i];
+	for (int i = arguments_count; i < function->locals_count; i++)
+		f->base[i] = Value();
+	pointer = f->base + function->locals_count - 1;
+
+	f->callee = function;
+	f->self = Value();
+	f->locals_count = function->locals_count;
+	f->previous = function->frame;
+
+	frame = f;
+	frames_pool_pointer = f - 1;
+	current = function->begin;
+}
+
+StringObject* VM::Intern(const char* cstr)
+{
+	if (constants != nullptr) {
+		auto shared = constants->Find(cstr);
+		if (shared != nullptr)
+			return shared;
+	}
+
+	auto found = strings.find(cstr);
+	if (found != strings.end())
+		return found->second;
+
+	auto string = new StringObject(cstr);
+	string->constant = true;
+	NewObject(string);
+	strings[cstr] = string;
+	return string;
+}
+
+UpvalueObject* VM::CaptureUpvalue(Frame* frame, int index)
+{
+	// Open upvalues are kept ordered by frame, newest frames first, so
+	// closing the locals of released frames only touches the head.
+	Value* location = &frame->locals[index];
+
+	// A frame of another context is reached only through the lexical chain
+	// of a function made there; it is read in place, as LOAD_FAST does,
+	// and keeps the coroutine that made the running function alive.
+	if (frame < frames_pool || frame >= frames_pool + frames_pool_size) {
+		auto upvalue = new UpvalueObject(location, nullptr);
+		if (call_frame != nullptr && call_frame->callee != nullptr)
+			upvalue->owner = call_frame->callee->owner;
+		NewObject(upvalue);
+		return upvalue;
+	}
+
+	UpvalueObject** link = &open_upvalues;
+	while (*link != nullptr && (*link)->frame < frame)
+		link = &(*link)->next;
+	for (auto i = *link; i != nullptr && i->frame == frame; i = i->next)
+		if (i->location == location)
+			return i;
+
+	auto upvalue = new UpvalueObject(location, frame);
+	upvalue->owner = running;
+	NewObject(upvalue);
+	upvalue->next = *link;
+	*link = upvalue;
+	return upvalue;
+}
+
+void VM::CloseUpvalues(Frame* frame)
+{
+	while (open_upvalues != nullptr && open_upvalues->frame <= frame)
+	{
+		open_upvalues->Close();
+		open_upvalues = open_upvalues->next;
+	}
+}
+
+void VM::Save(Context& context)
+{
+	context.stack = stack;
+	context.stack_size = stack_size;
+	context.pointer = pointer;
+	context.frames_pool = frames_pool;
+	context.frames_pool_size = frames_pool_size;
+	context.frames_pool_pointer = frames_pool_pointer;
+	context.frame = frame;
+	context.call_frame = call_frame;
+	context.current = current;
+	context.exit_frame = exit_frame;
+	context.open_upvalues = open_upvalues;
+}
+
+void VM::Load(Context& context)
+{
+	stack = context.stack;
+	stack_size = context.stack_size;
+	pointer = context.pointer;
+	frames_pool = context.frames_pool;
+	frames_pool_size = context.frames_pool_size;
+	frames_pool_pointer = context.frames_pool_pointer;
+	frame = context.frame;
+	call_frame = context.call_frame;
+	current = context.current;
+	exit_frame = context.exit_frame;
+	open_upvalues = context.open_upvalues;
+}
+
+// Switches to coroutine, which takes the arguments on top of the stack as
+// its parameters when it starts and the first of them as the value of its
+// yield otherwise. False, with nil pushed, when it cannot be resumed.
+bool VM::Resume(CoroutineObject* coroutine, int arguments_count, bool nested)
+{
+	Value* arguments = pointer - arguments_count + 1;
+	pointer -= arguments_count;
+	if (coroutine->state != CO_SUSPENDED) {
+		if (coroutine->state == CO_RUNNING)
+			cout << "Error: cannot resume a running coroutine." << endl;
+		Push(Value());
+		return false;
+	}
+
+	Save(coroutine->caller);
+	Load(coroutine->context);
+	coroutine->state = CO_RUNNING;
+	coroutine->nested = nested;
+	coroutine->resumer = running;
+	running = coroutine;
+
+	if (!coroutine->started) {
+		coroutine->started = true;
+		for (int i = 0; i < arguments_count; i++)
+			Push(arguments[i]);
+		Invoke(coroutine->function, Value(), arguments_count);
+	}
+	else if (coroutine->push_result)
+		Push(arguments_count > 0 ? arguments[0] : Value());
+	return true;
+}
+
+// Switches back from the running coroutine to its resumer, which gets
+// value. True when a native resumed it, whose Run has to return now.
+bool VM::Suspend(Value value, bool finished)
+{
+	CoroutineObject* coroutine = running;
+	coroutine->state = finished ? CO_DEAD : CO_SUSPENDED;
+	Save(coroutine->context);
+	Load(coroutine->caller);
+	running = coroutine->resumer;
+	coroutine->resumer = nullptr;
+	Push(value);
+	return coroutine->nested;
+}
+
+// True when count values fit above top, growing the stack of a running
+// coroutine if they do not yet.
+bool VM::StackRoom(Value* top, int count)
+{
+	if (top + count < stack + stack_size)
+		return true;
+	if (running != nullptr && running->GrowStack(this, static_cast<size_t>(top - pointer + count)))
+		return true;
+	Overflow("value stack overflow (" + to_string(stack_size) + " values)");
+	return false;
+}
+
+// Reports running out of room. A coroutine ends with the error and its
+// resumer gets nil. Otherwise the Run going on stops: the main program
+// ends, and a native that called back in gets nil from FunctionObject::Call.
+void VM::Overflow(const string& error)
+{
+	cout << "Error: " << error << "." << endl;
+	if (running == nullptr || exit_frame != nullptr) {
+		if (exit_frame == nullptr) {
+			// Back to the first frame and an empty stack, as an isolate may be used again.
+			Frame* first = frames_pool + frames_pool_size - 1;
+			CloseUpvalues(first);
+			frames_pool_pointer = first - 1;
+			frame = first;
+			call_frame = nullptr;
+			pointer = stack;
+		}
+		current = size;
+		return;
+	}
+	CloseUpvalues(frames_pool + frames_pool_size - 1);
+	// A native that resumed it returns from its Run at the end of the code.
+	if (Suspend(Value(), true))
+		current = size;
+}
+
+int VM::BindGlobal(const char* name)
+{
+	auto found = global_indices.find(name);
+	if (found != global_indices.end())
+		return found->second;
+	global_slots.push_back(&globals[name]);
+	int index = static_cast<int>(global_slots.size()) - 1;
+	global_indices[name] = index;
+	return index;
+}
+
+void VM::Branch(bool condition)
+{
+	pointer -= 2;
+	if (condition)
+		current++;
+	else
+		current = code[current].value.as.integer;
+}
+
+void VM::Deoptimize(OperationCode generic)
+{
+	Operation& operation = code[current - 1];
+	operation.code = generic;
+	operation.counter++;
+	current--;
 }
 
 int CreateClassInstance(VM* vm) {
@@ -478,6 +1637,7 @@ Value VM::Peek()
 
 Operation::Operation(OperationCode code) : code(code) {}
 Operation::Operation(OperationCode code, Value value) : code(code), value(value) {}
+Operation::Operation(OperationCode code, Value value, int argument) : code(code), value(value), argument(argument) {}
 
 Assembly::Assembly()
 {
@@ -505,12 +1665,17 @@ void Assembly::Set(int index, Value value)
 	operations.at(index).value = value;
 }
 
+void Assembly::SetArgument(int index, int argument)
+{
+	operations.at(index).argument = argument;
+}
+
 int Assembly::Size()
 {
 	return operations.size();
 }
 
-Frame::Frame() : previous(nullptr), return_address(-1) { }
+Frame::Frame() : previous(nullptr), return_address(-1), locals(storage) { }
 
 Value Frame::GetLocal(int index)
 {
@@ -543,7 +1708,7 @@ Value Compiler::GetClosure(const char* name, int depth)
 		if (strcmp(closures[i], name) == 0)
 			return Value(i);
 	}
-	if (previous != nullptr)
+	if (previous != nullptr && !function)
 		return previous->GetClosure(name, depth + 1);
 	return Value();
 }
@@ -4,17 +4,24 @@
 #include <vector>
 #include <stack>
 #include <map>
+#include <string_view>
 
 #include "Token.h"
 #include "Value.h"
+#include "Output.h"
 
 struct FnDefNode;
 enum ObjectType;
 
 using namespace std;
 
+// Orders C string keys by content. Also compares them with string_view,
+// so a string object is looked up by its characters without a copy.
 struct cstrcmp {
+	using is_transparent = void;
 	bool operator()(const char* lhs, const char* rhs) const;
+	bool operator()(const char* lhs, string_view rhs) const;
+	bool operator()(string_view lhs, const char* rhs) const;
 };
 
 struct Entry {
@@ -40,6 +47,38 @@ enum OperationCode {
 	OP_RETURN,
 
 	OP_NEW_OBJ, OP_SET_META,
+
+	OP_ADD_NUM, OP_SUBTRACT_NUM, OP_MULTIPLY_NUM, OP_DIVIDE_NUM,
+
+	OP_EQUAL_NUM, OP_NOT_EQUAL_NUM, OP_GREATER_NUM, OP_GREATER_EQUAL_NUM, OP_LESS_NUM, OP_LESS_EQUAL_NUM,
+
+	OP_ADD_STR,
+
+	OP_ADD_INT, OP_SUBTRACT_INT, OP_MULTIPLY_INT, OP_MOD_INT, OP_DIV_INT,
+
+	OP_EQUAL_INT, OP_NOT_EQUAL_INT, OP_GREATER_INT, OP_GREATER_EQUAL_INT, OP_LESS_INT, OP_LESS_EQUAL_INT,
+
+	OP_TEST_EQUAL_NUM, OP_TEST_NOT_EQUAL_NUM, OP_TEST_GREATER_NUM, OP_TEST_GREATER_EQUAL_NUM, OP_TEST_LESS_NUM, OP_TEST_LESS_EQUAL_NUM,
+
+	OP_TEST_EQUAL_INT, OP_TEST_NOT_EQUAL_INT, OP_TEST_GREATER_INT, OP_TEST_GREATER_EQUAL_INT, OP_TEST_LESS_INT, OP_TEST_LESS_EQUAL_INT,
+
+	OP_LOAD_GLOBAL, OP_STORE_GLOBAL,
+
+	OP_INVOKE, OP_TAIL_CALL,
+
+	OP_CAPTURE_FAST, OP_CAPTURE_CLOSURE, OP_CAPTURE_VALUE,
+
+	OP_LEN, OP_PUSH_STRING,
+
+	OP_YIELD, OP_RESUME,
+
+	OP_ADD_NUM_INT, OP_SUBTRACT_NUM_INT, OP_MULTIPLY_NUM_INT, OP_DIVIDE_NUM_INT,
+
+	OP_EQUAL_NUM_INT, OP_NOT_EQUAL_NUM_INT, OP_GREATER_NUM_INT, OP_GREATER_EQUAL_NUM_INT, OP_LESS_NUM_INT, OP_LESS_EQUAL_NUM_INT,
+
+	OP_ADD_INT_NUM, OP_SUBTRACT_INT_NUM, OP_MULTIPLY_INT_NUM, OP_DIVIDE_INT_NUM,
+
+	OP_EQUAL_INT_NUM, OP_NOT_EQUAL_INT_NUM, OP_GREATER_INT_NUM, OP_GREATER_EQUAL_INT_NUM, OP_LESS_INT_NUM, OP_LESS_EQUAL_INT_NUM,
 };
 
 string OperationCodeName(OperationCode code);
@@ -47,14 +86,18 @@ string OperationCodeName(OperationCode code);
 struct Operation {
 	OperationCode code;
 	Value value;
+	int counter = 0; // deoptimizations of a quickened operation, executions of a loop back-edge, cache slot of an invoke
+	int argument = 0; // arguments count of an invoke
 	Operation(OperationCode code);
 	Operation(OperationCode code, Value value);
+	Operation(OperationCode code, Value value, int argument);
 };
 
 
 struct Compiler
 {
 	bool global = false;
+	bool function = false;
 	Compiler* previous = nullptr;
 	vector<const char*> locals;
 	vector<const char*> closures;
@@ -70,16 +113,30 @@ struct Assembly {
 	void Save();
 	void Put(Operation operation);
 	void Set(int index, Value value);
+	void SetArgument(int index, int argument);
 	int Size();
 };
 
 class VM;
+class FunctionObject;
+class ValueTableObject;
+class UpvalueObject;
+class StringObject;
+class ConstantPool;
+class IsolatePool;
+class CoroutineObject;
 
 struct Frame {
 	VM* vm;
 	int return_address;
+	FunctionObject* callee = nullptr; // set on function frames, which own their locals on the value stack
+	Value self;
+	Value* base = nullptr;
+	Frame* caller = nullptr;
+	Frame* previous_call = nullptr;
 	Frame* previous;
-	Value locals[256];
+	Value* locals;
+	Value storage[256];
 	int locals_count = 0;
 	Frame();
 	Value GetLocal(int index);
@@ -94,16 +151,42 @@ struct Class {
 	vector<Member> members;
 };
 
-class FunctionObject;
+// Registers of one line of execution, the main program or a coroutine;
+// each runs on a value stack and a frame pool of its own.
+struct Context {
+	Value* stack = nullptr;
+	size_t stack_size = 0;
+	Value* pointer = nullptr;
+	Frame* frames_pool = nullptr;
+	int frames_pool_size = 0;
+	Frame* frames_pool_pointer = nullptr;
+	Frame* frame = nullptr;
+	Frame* call_frame = nullptr;
+	int current = 0;
+	Frame* exit_frame = nullptr;
+	UpvalueObject* open_upvalues = nullptr;
+};
+
+struct InvokeCache {
+	ValueTableObject* receiver = nullptr;
+	unsigned chain_version = 0; // sum of the versions from receiver to holder
+	ValueTableObject* holder = nullptr;
+	unsigned holder_version = 0;
+	Value method;
+};
 
 class VM {
 public:
 	map<const char*, Value, cstrcmp> globals;
+	vector<Value*> global_slots;
+	map<const char*, int, cstrcmp> global_indices; // index in global_slots of each bound name
 	Frame* frames_pool;
 	int frames_pool_size;
 	Frame* frames_pool_pointer;
 	Frame* frame;
 	Assembly& assembly;
+	vector<Operation> operations; // own copy of the code, quickening rewrites it
+	Operation* code;
 	Value* stack;
 	size_t stack_size;
 	int size;
@@ -113,12 +196,22 @@ public:
 	Object* objects_to_mark = nullptr;
 	int parameters_count;
 	int bytes_allocated = 0;
-	FunctionObject* callee;
-	bool exit_on_return = false;
-	VM(Assembly& assembly);
+	Frame* call_frame = nullptr;
+	UpvalueObject* open_upvalues = nullptr;
+	vector<InvokeCache> invoke_caches;
+	map<string, StringObject*> strings; // interned literals, alive as long as the VM
+	ConstantPool* constants; // literals shared with other isolates, looked up first
+	vector<Object*> natives; // objects added as globals, outside the heap
+	IsolatePool* isolates = nullptr; // pool spawn and parallel_map run on
+	CoroutineObject* running = nullptr; // coroutine the registers belong to, nullptr for the main program
+	Output output;
+	Frame* exit_frame = nullptr; // a nested Run returns once this frame does
+	VM(Assembly& assembly, ConstantPool* constants = nullptr);
 	~VM();
 	void Run();
 	void Add(const char* name, Value value);
+	template <typename R, typename... Args>
+	void Bind(const char* name, R(*function)(Args...));
 	void AddClassConstuctor(ObjectType type);
 	void Push(Value value);
 	void StoreLocal(int index, int depth, Value value);
@@ -132,9 +225,36 @@ public:
 	Value GetParameter(int index);
 	int GetParametersCount();
 	void NewObject(Object* object);
+	bool Invoke(FunctionObject* function, Value self, int arguments_count);
+	void TailInvoke(FunctionObject* function, int arguments_count);
+	StringObject* Intern(const char* cstr);
+	UpvalueObject* CaptureUpvalue(Frame* frame, int index);
+	void CloseUpvalues(Frame* frame);
+	void Save(Context& context);
+	void Load(Context& context);
+	void MarkContext(Context& context);
+	bool Resume(CoroutineObject* coroutine, int arguments_count, bool nested);
 private:
+	bool Suspend(Value value, bool finished);
+	bool StackRoom(Value* top, int count);
+	void Overflow(const string& error);
 	bool End();
-	Operation Advance();
+	Operation& Advance();
+	void Quicken(Operation& operation);
+	void Deoptimize(OperationCode generic);
+	bool NumberOperands();
+	bool IntegerOperands();
+	bool NumberIntegerOperands();
+	bool IntegerNumberOperands();
+	void IntegerOperate(long long value, OperationCode code);
+	void NumberOperate(double value, OperationCode code);
+	void OptimizeLoop(int begin, int end);
+	int BindGlobal(const char* name);
+	Value LookupMethod(Operation& operation, ValueTableObject* receiver);
+	Value IndexMethod(ValueTableObject* receiver, const char* name);
+	unsigned ChainVersion(ValueTableObject* receiver, ValueTableObject* holder);
+	bool BinaryMetamethod(OperationCode code, Value left);
+	void Branch(bool condition);
 };
 
 #endif
\ No newline at end of file
@@ -1,14 +1,50 @@
+#include <charconv>
+#include <cctype>
+#include <cstdlib>
+
 #include "Value.h"
 #include "Object.h"
 
+char* FormatNumber(char* buffer, double number)
+{
+	return std::to_chars(buffer, buffer + NUMBER_BUFFER, number).ptr;
+}
+
+char* FormatNumber(char* buffer, long long number)
+{
+	return std::to_chars(buffer, buffer + NUMBER_BUFFER, number).ptr;
+}
+
 Value::Value() { type = V_NIL; }
 Value::Value(int integer) { as.integer = integer; type = V_INTEGER; }
+Value::Value(long long integer) { as.integer = integer; type = V_INTEGER; }
 Value::Value(bool boolean) { as.boolean = boolean; type = V_BOOL; }
 Value::Value(double number) { as.number = number; type = V_NUMBER; }
 Value::Value(const char* cstr) { as.c_str = cstr; type = V_CSTRING; }
 Value::Value(short a, short b) { as.double16.a = a; as.double16.b = b; type = V_DOUBLE16; }
 Value::Value(Object* object) { as.object = object; type = V_OBJECT; }
 
+Value ParseNumber(const char* first, const char* last)
+{
+	while (first != last && isspace(static_cast<unsigned char>(*first)))
+		first++;
+	if (first != last && *first == '+')
+		first++;
+
+	long long integer;
+	auto parsed = std::from_chars(first, last, integer);
+	if (parsed.ec == std::errc() && (parsed.ptr == last || (*parsed.ptr != '.' && *parsed.ptr != 'e' && *parsed.ptr != 'E')))
+		return Value(integer);
+
+	double number;
+	parsed = std::from_chars(first, last, number);
+	if (parsed.ec == std::errc::invalid_argument)
+		return Value();
+	if (parsed.ec == std::errc::result_out_of_range)
+		return Value(strtod(std::string(first, parsed.ptr).c_str(), nullptr));
+	return Value(number);
+}
+
 std::string Value::ToString()
 {
 	if (type == V_BOOL)
@@ -22,10 +58,8 @@ std::string Value::ToString()
 
 	if (type == V_NUMBER)
 	{
-		string str = to_string(as.number);
-		str.erase(str.find_last_not_of('0') + 1, std::string::npos);
-		str.erase(str.find_last_not_of('.') + 1, std::string::npos);
-		return str;
+		char buffer[NUMBER_BUFFER];
+		return string(buffer, FormatNumber(buffer, as.number));
 	}
 
 	if (type == V_CSTRING)
@@ -39,3 +73,42 @@ std::string Value::ToString()
 
 	return string();
 }
+
+// Same text as ToString, appended without building a temporary string.
+void Value::AppendTo(std::string& buffer)
+{
+	char number[NUMBER_BUFFER];
+	switch (type)
+	{
+	case V_INTEGER:
+		buffer.append(number, FormatNumber(number, as.integer));
+		break;
+	case V_NUMBER:
+		buffer.append(number, FormatNumber(number, as.number));
+		break;
+	case V_CSTRING:
+		buffer += as.c_str;
+		break;
+	case V_OBJECT:
+		as.object->AppendTo(buffer);
+		break;
+	default:
+		buffer += ToString();
+		break;
+	}
+}
+
+bool Value::IsNumeric()
+{
+	return type == V_INTEGER || type == V_NUMBER;
+}
+
+double Value::ToNumber()
+{
+	return type == V_INTEGER ? static_cast<double>(as.integer) : as.number;
+}
+
+long long Value::ToInteger()
+{
+	return type == V_INTEGER ? as.integer : static_cast<long long>(as.number);
+}
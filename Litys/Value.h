@@ -5,6 +5,21 @@
 
 class Object;
 
+// Room for any number written by FormatNumber.
+const int NUMBER_BUFFER = 32;
+
+// Writes the shortest text that reads back as the same number into
+// buffer and returns the end of it.
+char* FormatNumber(char* buffer, double number);
+char* FormatNumber(char* buffer, long long number);
+
+struct Value;
+
+// Reads the number at the start of [first, last), after any blanks: an
+// integer when it is written as one and fits, a double otherwise, nil
+// when there is no number.
+Value ParseNumber(const char* first, const char* last);
+
 enum ValueType {
 	V_NIL,
 	V_INTEGER,
@@ -22,7 +37,7 @@ public:
 		struct {
 			short a, b;
 		} double16;
-		int integer;
+		long long integer;
 		double number;
 		const char* c_str;
 		bool boolean;
@@ -30,12 +45,17 @@ public:
 	} as;
 	Value();
 	Value(int integer);
+	Value(long long integer);
 	Value(bool boolean);
 	Value(double number);
 	Value(const char* cstr);
 	Value(short a, short b);
 	Value(Object* object);
 	std::string ToString();
+	void AppendTo(std::string& buffer);
+	bool IsNumeric();
+	double ToNumber();
+	long long ToInteger();
 };
 
 #endif
\ No newline at end of file
@@ -0,0 +1,19 @@
+#!/bin/sh
+# Times isolates.lts in the isolate pool with more and more workers. The
+# top level of the script builds a table every task reads, so the time of
+# a task shows whether the top level runs once per isolate or once per
+# task.
+#   benchmarks/isolates.sh path/to/Litys [tasks]
+litys=$1
+tasks=${2:-200}
+if [ -z "$litys" ]; then
+	echo "usage: $0 path/to/Litys [tasks]"
+	exit 2
+fi
+cd "$(dirname "$0")"
+for threads in 1 2 4 8; do
+	start=$(date +%s.%N)
+	"$litys" isolates.lts --isolates $threads work $tasks > /dev/null
+	end=$(date +%s.%N)
+	echo "$threads threads, $tasks tasks: $(awk "BEGIN { printf \"%.2f\", $end - $start }") s"
+done
@@ -0,0 +1,25 @@
+#!/bin/sh
+# Runs every script here with the given interpreter and compares what it
+# prints with the .out file next to it. A .args file next to a script
+# holds more arguments for its command line.
+#   tests/run.sh path/to/Litys
+litys=$1
+if [ -z "$litys" ]; then
+	echo "usage: $0 path/to/Litys"
+	exit 2
+fi
+cd "$(dirname "$0")"
+failed=0
+for script in *.lts; do
+	args=
+	if [ -f "${script%.lts}.args" ]; then
+		args=$(cat "${script%.lts}.args")
+	fi
+	if "$litys" "$script" $args 2>&1 | diff -u "${script%.lts}.out" - > /dev/null; then
+		echo "ok   $script"
+	else
+		echo "FAIL $script"
+		failed=1
+	fi
+done
+exit $failed